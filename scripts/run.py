@@ -12,7 +12,7 @@ from jinja2 import Template
 from psycopg2.extras import RealDictCursor
 
 
-def execute(query, connect=None, dsn=None, is_autocommit=False):
+def execute(query, connect=None, dsn=None, is_autocommit=False, notices=None):
     if connect:
         connect, is_close_connect = connect, False
     else:
@@ -29,7 +29,10 @@ def execute(query, connect=None, dsn=None, is_autocommit=False):
         return None, None, False
     finally:
         while connect.notices:
-            print(connect.notices.pop(0), end='')
+            notice = connect.notices.pop(0)
+            if notices is not None:
+                notices.append(notice.strip())
+            print(notice, end='')
     try:
         res = cursor.fetchall()
     except:
@@ -76,17 +79,27 @@ def cycle_test(
     dsn,
     cycle,
     n,
+    requires,
     pre,
     query,
     expect_result,
     expect_pgerror,
+    expect_notices,
     query_print_format
 ):
+    # test of a server feature is skipped when the feature is off
+    if requires:
+        result, _, _ = execute(requires, connect=connect, dsn=dsn)
+        if not result or not list(result[0].values())[0]:
+            print('skipped: {}'.format(query))
+            return None
     if pre:
         execute(pre, connect=connect, dsn=dsn)
     query_start_time = time.time()
 
-    result, pgerror, is_ok = execute(query, connect=connect, dsn=dsn)
+    notices = []
+    result, pgerror, is_ok = execute(query, connect=connect, dsn=dsn,
+                                     notices=notices)
     if not is_ok:
         if expect_pgerror:
             if expect_pgerror == pgerror:
@@ -98,6 +111,8 @@ def cycle_test(
         check = check_result(result, expect_result)
     else:
         check = True
+    if expect_notices is not None:
+        check = check and notices == expect_notices
     if query_print_format:
         print(
             query_print_format.format(
@@ -141,10 +156,12 @@ def test(
                 dsn,
                 cycle,
                 n,
+                q.get('requires'),
                 q.get('pre'),
                 q['query'],
                 q.get('result'),
                 q.get('pgerror'),
+                q.get('notices'),
                 query_print_format,
             )
             for n, q in enumerate(tests)
@@ -164,9 +181,10 @@ def test(
             print(
                 cycle_print_format.format(
                     cycle=cycle,
-                    check_stat='{}, {}'.format(
+                    check_stat='{}, {}, {}'.format(
                         'ok: {}'.format(checks.count(True)),
-                        'fail: {}'.format(checks.count(False))),
+                        'fail: {}'.format(checks.count(False)),
+                        'skip: {}'.format(checks.count(None))),
                     time=time.time() - cycle_start_time
                 )
             )
@@ -0,0 +1,47 @@
+-- plexor 2.3 to 2.4
+
+-- open connections to all nodes of the cluster
+CREATE FUNCTION plexor_warmup (cluster text, prepare boolean DEFAULT false)
+RETURNS integer AS 'plexor' LANGUAGE C STRICT;
+
+-- compile plexor functions matching the pattern ahead of their first call
+CREATE FUNCTION plexor_precompile (pattern text)
+RETURNS integer AS 'plexor' LANGUAGE C STRICT;
+
+-- shared node health registry
+CREATE FUNCTION plexor_node_status (
+    OUT server oid,
+    OUT node integer,
+    OUT state text,
+    OUT failures integer,
+    OUT last_failure timestamptz,
+    OUT calls integer,
+    OUT call_limit integer,
+    OUT queued integer)
+RETURNS SETOF record AS 'plexor' LANGUAGE C;
+
+-- calls delivered by the outbox worker
+CREATE SCHEMA plexor;
+
+CREATE TABLE plexor.outbox (
+    id              bigserial PRIMARY KEY,
+    fn              regprocedure NOT NULL,
+    args            text[] NOT NULL,
+    enqueued_at     timestamptz NOT NULL DEFAULT now(),
+    attempts        integer NOT NULL DEFAULT 0,
+    next_attempt_at timestamptz NOT NULL DEFAULT now(),
+    last_error      text,
+    role            regrole NOT NULL);
+
+CREATE INDEX outbox_next_attempt_at_idx ON plexor.outbox (next_attempt_at);
+
+-- store a plexor function call in the outbox to be made as the current
+-- role, returns the call id
+CREATE FUNCTION plexor_enqueue (fn regprocedure, VARIADIC args text[] DEFAULT '{}')
+RETURNS bigint AS 'plexor' LANGUAGE C STRICT;
+
+-- deliver due outbox calls in the current transaction, one pass of the worker
+CREATE FUNCTION plexor_outbox_drain ()
+RETURNS integer AS 'plexor' LANGUAGE C;
+SELECT pg_catalog.pg_extension_config_dump('plexor.outbox', '');
+SELECT pg_catalog.pg_extension_config_dump('plexor.outbox_id_seq', '');
@@ -46,6 +46,19 @@ static MemoryContext plx_cluster_mctx;
 /* Cluster cache */
 static HTAB *plx_cluster_cache = NULL;
 
+/*
+ * Cached clusters are valid while their generation matches. It is advanced
+ * when any foreign server changes, ALTER SERVER is then seen on next call.
+ */
+static uint64 plx_cluster_generation = 1;
+
+
+static void
+cluster_syscache_callback(Datum arg, int cacheid, uint32 hashvalue)
+{
+    plx_cluster_generation++;
+}
+
 
 /* Initialize plexor cluster cache */
 void
@@ -75,6 +88,8 @@ plx_cluster_cache_init(void)
     old_ctx = MemoryContextSwitchTo(plx_cluster_mctx);
     plx_cluster_cache = hash_create("Plexor clusters cache", max_clusters, &ctl, flags);
     MemoryContextSwitchTo(old_ctx);
+
+    CacheRegisterSyscacheCallback(FOREIGNSERVEROID, cluster_syscache_callback, (Datum) 0);
 }
 
 /* Search for cluster in cache */
@@ -130,32 +145,84 @@ extract_node_num(const char *node_name, int *node_num)
     return false;
 }
 
-void
-delete_plx_cluster(PlxCluster *plx_cluster)
+/* Free node definitions and settings, the structure itself is kept */
+static void
+reset_plx_cluster(PlxCluster *plx_cluster)
 {
-    if (plx_cluster_lookup_cache(plx_cluster->name))
-        plx_cluster_cache_delete(plx_cluster->name);
     if (plx_cluster->isolation_level)
         pfree(plx_cluster->isolation_level);
+    plx_cluster->isolation_level = NULL;
+    if (plx_cluster->nodes)
+    {
+        int i;
+
+        for (i = 0; i < plx_cluster->nnodes; i++)
+            if (plx_cluster->nodes[i])
+                pfree(plx_cluster->nodes[i]);
+        pfree(plx_cluster->nodes);
+    }
+    plx_cluster->nodes = NULL;
+    if (plx_cluster->node_health)
+        pfree(plx_cluster->node_health);
+    plx_cluster->node_health = NULL;
+    plx_cluster->nnodes = 0;
 }
 
-static PlxCluster*
-new_plx_cluster(char* name)
+void
+delete_plx_cluster(PlxCluster *plx_cluster)
 {
-    ForeignServer *foreign_server;
-    PlxCluster    *plx_cluster;
-    ListCell      *cell;
+    if (plx_cluster_lookup_cache(plx_cluster->name) == plx_cluster)
+        plx_cluster_cache_delete(plx_cluster->name);
+    reset_plx_cluster(plx_cluster);
+}
 
-    foreign_server = GetForeignServerByName(name, true);
-    if (!foreign_server)
-        elog(ERROR, "cluster (%s) not found", name);
+/*
+ * Parse foreign server options into the cluster. Connections keep a pointer
+ * to their cluster, so a changed cluster is filled again in place.
+ */
+static void
+fill_plx_cluster(PlxCluster *plx_cluster, ForeignServer *foreign_server,
+                 uint64 generation)
+{
+    ListCell *cell;
+    int       nnodes = 0;
 
-    plx_cluster = MemoryContextAllocZero(plx_cluster_mctx, sizeof(PlxCluster));
+    reset_plx_cluster(plx_cluster);
     /* isolation_level default value */
     plx_cluster->isolation_level = mctx_strcpy(plx_cluster_mctx, "read committed");
     plx_cluster->connection_lifetime = 0;
+    plx_cluster->connection_idle_timeout = 0;
+    plx_cluster->failure_threshold = 5;
+    plx_cluster->failure_timeout = 10;
+    plx_cluster->any_affinity = false;
+    plx_cluster->node_max_calls = 0;
+    plx_cluster->node_target_latency = 0;
+    plx_cluster->node_queue_timeout = 0;
     plx_cluster->oid = foreign_server->serverid;
-    strcpy(plx_cluster->name, foreign_server->servername);
+    strlcpy(plx_cluster->name, foreign_server->servername, NAMEDATALEN);
+
+    /* node arrays are sized by the highest node number */
+    foreach(cell, foreign_server->options)
+    {
+        DefElem *def = lfirst(cell);
+        int      node_num;
+
+        if (extract_node_num(def->defname, &node_num))
+        {
+            if (node_num < 0 || node_num >= MAX_NODES)
+                elog(ERROR, "node number %d of cluster (%s) is out of range (max %d)",
+                     node_num, plx_cluster->name, MAX_NODES - 1);
+            nnodes = Max(nnodes, node_num + 1);
+        }
+    }
+    if (nnodes > 0)
+    {
+        plx_cluster->nodes = MemoryContextAllocZero(plx_cluster_mctx,
+                                                    sizeof(char *) * nnodes);
+        plx_cluster->node_health = MemoryContextAllocZero(plx_cluster_mctx,
+                                                          sizeof(PlxNodeHealth *) * nnodes);
+    }
+    plx_cluster->nnodes = nnodes;
 
     foreach(cell, foreign_server->options)
     {
@@ -164,8 +231,9 @@ new_plx_cluster(char* name)
 
         if (extract_node_num(def->defname, &node_num))
         {
-            strcpy(plx_cluster->nodes[node_num], strVal(def->arg));
-            plx_cluster->nnodes = node_num + 1;
+            if (plx_cluster->nodes[node_num])
+                pfree(plx_cluster->nodes[node_num]);
+            plx_cluster->nodes[node_num] = mctx_strcpy(plx_cluster_mctx, strVal(def->arg));
         }
         else if (!strcmp(def->defname, "isolation_level"))
         {
@@ -177,19 +245,64 @@ new_plx_cluster(char* name)
             char *endptr;
             plx_cluster->connection_lifetime = (int) strtoul(defGetString(def), &endptr, 10);
         }
+        else if (!strcmp(def->defname, "connection_idle_timeout"))
+        {
+            char *endptr;
+            plx_cluster->connection_idle_timeout = (int) strtoul(defGetString(def), &endptr, 10);
+        }
+        else if (!strcmp(def->defname, "failure_threshold"))
+        {
+            char *endptr;
+            plx_cluster->failure_threshold = (int) strtoul(defGetString(def), &endptr, 10);
+        }
+        else if (!strcmp(def->defname, "failure_timeout"))
+        {
+            char *endptr;
+            plx_cluster->failure_timeout = (int) strtoul(defGetString(def), &endptr, 10);
+        }
+        else if (!strcmp(def->defname, "any_affinity"))
+            plx_cluster->any_affinity = defGetBoolean(def);
+        else if (!strcmp(def->defname, "node_max_calls"))
+        {
+            char *endptr;
+            plx_cluster->node_max_calls = (int) strtoul(defGetString(def), &endptr, 10);
+        }
+        else if (!strcmp(def->defname, "node_target_latency"))
+        {
+            char *endptr;
+            plx_cluster->node_target_latency = (int) strtoul(defGetString(def), &endptr, 10);
+        }
+        else if (!strcmp(def->defname, "node_queue_timeout"))
+        {
+            char *endptr;
+            plx_cluster->node_queue_timeout = (int) strtoul(defGetString(def), &endptr, 10);
+        }
     }
-    return plx_cluster;
+    /* set last, cluster failed to fill is filled again on next call */
+    plx_cluster->generation = generation;
 }
 
 PlxCluster*
 get_plx_cluster(char* name)
 {
-    PlxCluster *plx_cluster = plx_cluster_lookup_cache(name);
+    PlxCluster    *plx_cluster = plx_cluster_lookup_cache(name);
+    ForeignServer *foreign_server;
+    uint64         generation = plx_cluster_generation;
 
-    if (plx_cluster)
+    if (plx_cluster && plx_cluster->generation == generation)
         return plx_cluster;
 
-    plx_cluster = new_plx_cluster(name);
+    foreign_server = GetForeignServerByName(name, true);
+    if (!foreign_server)
+        elog(ERROR, "cluster (%s) not found", name);
+
+    if (plx_cluster)
+    {
+        fill_plx_cluster(plx_cluster, foreign_server, generation);
+        return plx_cluster;
+    }
+    plx_cluster = MemoryContextAllocZero(plx_cluster_mctx, sizeof(PlxCluster));
+    fill_plx_cluster(plx_cluster, foreign_server, generation);
     plx_cluster_insert_cache(plx_cluster);
     return plx_cluster;
 }
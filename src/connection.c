@@ -37,6 +37,51 @@ static MemoryContext plx_conn_mctx;
 /* Cluster cache */
 HTAB *plx_conn_cache = NULL;
 
+/* Cached connections, most recently used first */
+static dlist_head plx_conn_lru = DLIST_STATIC_INIT(plx_conn_lru);
+
+/* Time at which idle connections were checked last time */
+static time_t last_reap_time = 0;
+
+/*
+ * Connection slots of all clusters are valid while their generation matches.
+ * It is advanced when a connection is deleted and when user mappings,
+ * foreign servers or roles change.
+ */
+static uint64 plx_conn_slots_generation = 1;
+
+/* Connections deleted inside remote transaction, work done over them is lost */
+uint64 plx_lost_remote_xacts = 0;
+
+static void conn_xact_callback(XactEvent event, void *arg);
+static void wait_for_connects(PlxConn **plx_conns, int nconns);
+static const char *connect_error_message(PlxConn *plx_conn);
+static StringInfo get_dsn(PlxCluster *plx_cluster, const char *dsn);
+
+static void
+conn_slots_syscache_callback(Datum arg, int cacheid, uint32 hashvalue)
+{
+    plx_conn_slots_generation++;
+}
+
+/*
+ * Connection cache is keyed by pointer to DSN of the connection, so the DSN
+ * length isn't limited. Key is hashed and compared as the string.
+ */
+static uint32
+dsn_hash(const void *key, Size keysize)
+{
+    const char *dsn = *(const char * const *) key;
+
+    return string_hash(dsn, strlen(dsn) + 1);
+}
+
+static int
+dsn_match(const void *key1, const void *key2, Size keysize)
+{
+    return strcmp(*(const char * const *) key1, *(const char * const *) key2);
+}
+
 /* Initialize plexor connection cache */
 void
 plx_conn_cache_init(void)
@@ -56,15 +101,124 @@ plx_conn_cache_init(void)
                                           ALLOCSET_SMALL_INITSIZE,
                                           ALLOCSET_SMALL_MAXSIZE);
     MemSet(&ctl, 0, sizeof(ctl));
-    ctl.keysize = MAX_DSN_LEN;
+    ctl.keysize = sizeof(const char *);
     ctl.entrysize = sizeof(PlxConnHashEntry);
-    ctl.hash = string_hash;
+    ctl.hash = dsn_hash;
+    ctl.match = dsn_match;
     ctl.hcxt = plx_conn_mctx;
-    flags = HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT;
+    flags = HASH_ELEM | HASH_FUNCTION | HASH_COMPARE | HASH_CONTEXT;
 
     old_ctx = MemoryContextSwitchTo(plx_conn_mctx);
     plx_conn_cache = hash_create("Plexor connections cache", max_conns, &ctl, flags);
     MemoryContextSwitchTo(old_ctx);
+
+    RegisterXactCallback(conn_xact_callback, NULL);
+    CacheRegisterSyscacheCallback(USERMAPPINGOID, conn_slots_syscache_callback, (Datum) 0);
+    CacheRegisterSyscacheCallback(FOREIGNSERVEROID, conn_slots_syscache_callback, (Datum) 0);
+    CacheRegisterSyscacheCallback(AUTHOID, conn_slots_syscache_callback, (Datum) 0);
+    CacheRegisterSyscacheCallback(AUTHMEMROLEMEM, conn_slots_syscache_callback, (Datum) 0);
+}
+
+/*
+ * Get connection slots of the current user for the cluster. Stale slots are
+ * cleared, so the node DSN and permissions are checked again.
+ */
+static PlxConnSlots *
+get_plx_conn_slots(PlxCluster *plx_cluster)
+{
+    Oid           userid = GetUserId();
+    PlxConnSlots *slots;
+
+    for (slots = plx_cluster->conn_slots; slots; slots = slots->next)
+        if (slots->userid == userid)
+            break;
+
+    if (!slots)
+    {
+        slots = MemoryContextAllocZero(plx_conn_mctx, sizeof(PlxConnSlots));
+        slots->userid = userid;
+        slots->generation = plx_conn_slots_generation;
+        slots->nconns = plx_cluster->nnodes;
+        slots->conns = MemoryContextAllocZero(plx_conn_mctx,
+                                              sizeof(PlxConn *) * slots->nconns);
+        slots->dsns = MemoryContextAllocZero(plx_conn_mctx,
+                                             sizeof(char *) * slots->nconns);
+        slots->local_nodes = MemoryContextAllocZero(plx_conn_mctx, slots->nconns);
+        slots->next = plx_cluster->conn_slots;
+        plx_cluster->conn_slots = slots;
+    }
+    else if (slots->generation != plx_conn_slots_generation ||
+             slots->nconns != plx_cluster->nnodes)
+    {
+        int i;
+
+        for (i = 0; i < slots->nconns; i++)
+            if (slots->dsns[i])
+                pfree(slots->dsns[i]);
+        /* nodes may be added or removed by ALTER SERVER */
+        if (slots->nconns != plx_cluster->nnodes)
+        {
+            pfree(slots->conns);
+            pfree(slots->dsns);
+            pfree(slots->local_nodes);
+            slots->nconns = plx_cluster->nnodes;
+            slots->conns = MemoryContextAllocZero(plx_conn_mctx,
+                                                  sizeof(PlxConn *) * slots->nconns);
+            slots->dsns = MemoryContextAllocZero(plx_conn_mctx,
+                                                 sizeof(char *) * slots->nconns);
+            slots->local_nodes = MemoryContextAllocZero(plx_conn_mctx, slots->nconns);
+        }
+        else
+        {
+            MemSet(slots->conns, 0, sizeof(PlxConn *) * slots->nconns);
+            MemSet(slots->dsns, 0, sizeof(char *) * slots->nconns);
+            MemSet(slots->local_nodes, 0, slots->nconns);
+        }
+        slots->generation = plx_conn_slots_generation;
+    }
+    return slots;
+}
+
+/*
+ * DSN with user of the node for the user of the slots. It is built once,
+ * until the slots are cleared by user mapping or server change.
+ */
+static char *
+get_slots_dsn(PlxCluster *plx_cluster, PlxConnSlots *slots, int nnode)
+{
+    if (!slots->dsns[nnode])
+        slots->dsns[nnode] = MemoryContextStrdup(plx_conn_mctx,
+                                                 get_dsn(plx_cluster, plx_cluster->nodes[nnode])->data);
+    return slots->dsns[nnode];
+}
+
+/*
+ * Node for `run on any` of cluster with any_affinity. A node the current
+ * user has remote transaction open on is preferred, so fewer nodes take part
+ * in the commit, then a node with a resolved connection. Returns -1 if there
+ * is no such node.
+ */
+int
+get_plx_affinity_nnode(PlxCluster *plx_cluster)
+{
+    PlxConnSlots *slots  = get_plx_conn_slots(plx_cluster);
+    int           start  = rand() % plx_cluster->nnodes;
+    int           cached = -1;
+    int           i;
+
+    for (i = 0; i < plx_cluster->nnodes; i++)
+    {
+        int      nnode    = (start + i) % plx_cluster->nnodes;
+        PlxConn *plx_conn = slots->conns[nnode];
+
+        if (!plx_conn)
+            continue;
+        if (plx_conn->xlevel > 0)
+            return nnode;
+        if (cached == -1 && is_plx_node_available(plx_cluster, nnode, false))
+            cached = nnode;
+    }
+    return cached;
 }
 
 /* Search for connection in cache */
@@ -73,12 +227,156 @@ plx_conn_lookup_cache(const char *dsn)
 {
     PlxConnHashEntry *hentry;
 
-    hentry = hash_search(plx_conn_cache, dsn, HASH_FIND, NULL);
+    hentry = hash_search(plx_conn_cache, &dsn, HASH_FIND, NULL);
     if (hentry)
         return hentry->plx_conn;
     return NULL;
 }
 
+/*
+ * DSN of the node if the call can be handed to the multiplexer: it needs no
+ * remote transaction and the session has neither remote transaction nor
+ * deferred calls on the node. Returns NULL otherwise, then the call goes
+ * over a connection of the session.
+ */
+char *
+get_plx_mux_dsn(PlxCluster *plx_cluster, PlxFn *plx_fn, int nnode)
+{
+    PlxConnSlots *slots;
+    PlxConn      *plx_conn;
+    char         *dsn;
+
+    if ((strcmp(plx_cluster->isolation_level, "auto commit") != 0 && !plx_fn->is_read_only) ||
+        plx_fn->is_deferred ||
+        *plx_idempotency_key ||
+        nnode < 0 || nnode >= plx_cluster->nnodes || !plx_cluster->nodes[nnode] ||
+        /* half open node is probed over a connection of the session */
+        !is_plx_node_available(plx_cluster, nnode, false) ||
+        !plx_mux_attach())
+        return NULL;
+
+    slots = get_plx_conn_slots(plx_cluster);
+    plx_conn = slots->conns[nnode];
+    if (!plx_conn)
+    {
+        dsn = get_slots_dsn(plx_cluster, slots, nnode);
+        plx_conn = plx_conn_lookup_cache(dsn);
+    }
+    if (plx_conn && (plx_conn->xlevel > 0 || plx_conn->ndeferred > 0))
+        return NULL;
+    /* slots may be cleared while the arguments are encoded */
+    return pstrdup(get_slots_dsn(plx_cluster, slots, nnode));
+}
+
+/* Local host is either unix socket or loopback address */
+static bool
+is_local_host(const char *host)
+{
+    return host == NULL || *host == '\0' || *host == '/' ||
+           strcmp(host, "localhost") == 0 ||
+           strcmp(host, "127.0.0.1") == 0 ||
+           strcmp(host, "::1") == 0;
+}
+
+/* DSN points to the database of the backend as the current user */
+static bool
+is_local_dsn(const char *dsn)
+{
+    PQconninfoOption *opts;
+    PQconninfoOption *opt;
+    char             *dbname   = NULL;
+    char             *user     = NULL;
+    char             *host     = NULL;
+    char             *hostaddr = NULL;
+    char             *port     = NULL;
+    bool              is_local;
+
+    opts = PQconninfoParse(dsn, NULL);
+    if (!opts)
+        return false;
+    for (opt = opts; opt->keyword; opt++)
+    {
+        if (strcmp(opt->keyword, "dbname") == 0)
+            dbname = opt->val;
+        else if (strcmp(opt->keyword, "user") == 0)
+            user = opt->val;
+        else if (strcmp(opt->keyword, "host") == 0)
+            host = opt->val;
+        else if (strcmp(opt->keyword, "hostaddr") == 0)
+            hostaddr = opt->val;
+        else if (strcmp(opt->keyword, "port") == 0)
+            port = opt->val;
+    }
+    is_local = dbname && user &&
+               strcmp(dbname, get_database_name(MyDatabaseId)) == 0 &&
+               strcmp(user, GetUserNameFromId(GetUserId(), false)) == 0 &&
+               is_local_host(host) && is_local_host(hostaddr) &&
+               (port && *port ? atoi(port) : DEF_PGPORT) == PostPortNumber;
+    PQconninfoFree(opts);
+    return is_local;
+}
+
+/*
+ * Node can be called in process if the local fast path is enabled and the
+ * node DSN points to the current database as the current user. Like the
+ * multiplexer, the node must have neither remote transaction nor deferred
+ * calls of the session. Whether the node is local is kept in the slots
+ * until they are cleared.
+ */
+bool
+is_plx_local_node(PlxCluster *plx_cluster, PlxFn *plx_fn, int nnode)
+{
+    PlxConnSlots *slots;
+    PlxConn      *plx_conn;
+
+    if (!plx_local_fast_path ||
+        plx_fn->is_deferred ||
+        nnode < 0 || nnode >= plx_cluster->nnodes || !plx_cluster->nodes[nnode])
+        return false;
+
+    slots = get_plx_conn_slots(plx_cluster);
+    if (!slots->local_nodes[nnode])
+        slots->local_nodes[nnode] = is_local_dsn(get_slots_dsn(plx_cluster, slots, nnode)) ? 1 : -1;
+    if (slots->local_nodes[nnode] < 0)
+        return false;
+    plx_conn = slots->conns[nnode] ? slots->conns[nnode]
+                                   : plx_conn_lookup_cache(get_slots_dsn(plx_cluster, slots, nnode));
+    return !plx_conn || (plx_conn->xlevel == 0 && plx_conn->ndeferred == 0);
+}
+
+static bool
+is_plx_conn_idle(PlxConn *plx_conn)
+{
+    return plx_conn->xlevel == 0 &&
+           PQtransactionStatus(plx_conn->pq_conn) != PQTRANS_ACTIVE;
+}
+
+/*
+ * Close least recently used idle connections until there is a room for
+ * one more connection. Connections inside remote transaction are kept,
+ * so the limit may be exceeded.
+ */
+static void
+plx_conn_evict(void)
+{
+    dlist_mutable_iter iter;
+    long               nconns = hash_get_num_entries(plx_conn_cache);
+
+    if (plx_max_connections <= 0 || nconns < plx_max_connections)
+        return;
+
+    dlist_reverse_foreach_modify(iter, &plx_conn_lru)
+    {
+        PlxConn *plx_conn = dlist_container(PlxConn, lru_node, iter.cur);
+
+        if (!is_plx_conn_idle(plx_conn))
+            continue;
+        delete_plx_conn(plx_conn);
+        if (--nconns < plx_max_connections)
+            break;
+    }
+}
+
 /* Insert connection into cache */
 static void
 plx_conn_insert_cache(PlxConn *plx_conn)
@@ -86,18 +384,30 @@ plx_conn_insert_cache(PlxConn *plx_conn)
     PlxConnHashEntry *hentry;
     bool              found;
 
-    hentry = hash_search(plx_conn_cache, plx_conn->dsn, HASH_ENTER, &found);
+    plx_conn_evict();
+    hentry = hash_search(plx_conn_cache, &plx_conn->dsn, HASH_ENTER, &found);
     if (found)
         elog(ERROR, "connection '%s' is already in cache", plx_conn->dsn);
     hentry->plx_conn = plx_conn;
+    dlist_push_head(&plx_conn_lru, &plx_conn->lru_node);
+    plx_conn->last_used_time = time(NULL);
 }
 
 
 /* Delete connection from cache */
 static void
-plx_conn_cache_delete(const char *dsn)
+plx_conn_cache_delete(PlxConn *plx_conn)
+{
+    hash_search(plx_conn_cache, &plx_conn->dsn, HASH_REMOVE, NULL);
+    dlist_delete(&plx_conn->lru_node);
+}
+
+/* Mark connection as the most recently used */
+static void
+plx_conn_touch(PlxConn *plx_conn)
 {
-    hash_search(plx_conn_cache, dsn, HASH_REMOVE, NULL);
+    dlist_move_head(&plx_conn_lru, &plx_conn->lru_node);
+    plx_conn->last_used_time = time(NULL);
 }
 
 static UserMapping *
@@ -159,17 +469,24 @@ get_dsn(PlxCluster *plx_cluster, const char *dsn)
 void
 delete_plx_conn(PlxConn *plx_conn)
 {
-    if (plx_conn_lookup_cache(plx_conn->dsn))
-        plx_conn_cache_delete(plx_conn->dsn);
+    plx_conn_slots_generation++;
+    if (plx_conn->xlevel > 0)
+        plx_lost_remote_xacts++;
+    if (plx_conn_lookup_cache(plx_conn->dsn) == plx_conn)
+        plx_conn_cache_delete(plx_conn);
     if (plx_conn->dsn)
         pfree(plx_conn->dsn);
+    if (plx_conn->wait_set)
+        FreeWaitEventSet(plx_conn->wait_set);
+    if (plx_conn->xact_cmds.data)
+        pfree(plx_conn->xact_cmds.data);
     if (plx_conn->pq_conn)
         PQfinish(plx_conn->pq_conn);
     pfree(plx_conn);
 }
 
 static PlxConn*
-new_plx_conn(PlxCluster *plx_cluster, int nnode, char *dsn)
+new_plx_conn(PlxCluster *plx_cluster, int nnode, char *dsn, bool is_async)
 {
     PlxConn        *plx_conn;
     struct timeval  now;
@@ -180,54 +497,191 @@ new_plx_conn(PlxCluster *plx_cluster, int nnode, char *dsn)
     plx_conn->plx_cluster = plx_cluster;
     plx_conn->nnode = nnode;
     plx_conn->dsn = pstrdup(dsn);
-    plx_conn->pq_conn = PQconnectdb(plx_conn->dsn);
+    if (is_async)
+        plx_conn->pq_conn = PQconnectStart(plx_conn->dsn);
+    else
+        plx_conn->pq_conn = PQconnectdb(plx_conn->dsn);
     MemoryContextSwitchTo(old_ctx);
     gettimeofday(&now, NULL);
     plx_conn->connect_time = now.tv_sec;
+    /*
+     * Lifetime is shortened by up to 10% at random, so backends connected
+     * at the same moment don't reconnect at the same moment too.
+     */
+    if (plx_cluster->connection_lifetime > 0)
+        plx_conn->expire_time = now.tv_sec
+                                + plx_cluster->connection_lifetime
+                                - rand() % (plx_cluster->connection_lifetime / 10 + 1);
     return plx_conn;
 }
 
 static bool
 is_lifetime_is_over(PlxConn *plx_conn)
 {
-    PlxCluster *plx_cluster = plx_conn->plx_cluster;
-    struct timeval now;
+    return plx_conn->expire_time > 0 && time(NULL) > plx_conn->expire_time;
+}
 
-    gettimeofday(&now, NULL);
-    if (plx_cluster->connection_lifetime > 0 &&
-        (now.tv_sec - plx_conn->connect_time) > plx_cluster->connection_lifetime)
+/*
+ * Cheap check that an idle cached connection is still usable. Nothing but
+ * notices is expected from the node between queries, so readable socket
+ * usually means that the node was restarted or the connection was closed
+ * by the network.
+ */
+static bool
+is_plx_conn_alive(PlxConn *plx_conn)
+{
+    PGconn        *pq_conn = plx_conn->pq_conn;
+    struct pollfd  pfd;
+
+    if (PQstatus(pq_conn) != CONNECTION_OK)
+        return false;
+
+    pfd.fd = PQsocket(pq_conn);
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    if (poll(&pfd, 1, 0) <= 0)
         return true;
-    return false;
+
+    return PQconsumeInput(pq_conn) && PQstatus(pq_conn) == CONNECTION_OK;
+}
+
+/*
+ * Create wait event set with process latch and postmaster death events at
+ * positions 0 and 1. Session set lives until it is freed explicitly,
+ * otherwise it is released on error as well.
+ */
+WaitEventSet *
+create_wait_set(int nevents, bool is_session)
+{
+    WaitEventSet *wait_set;
+
+#if PG_VERSION_NUM >= 170000
+    wait_set = CreateWaitEventSet(is_session ? NULL : CurrentResourceOwner, nevents + 2);
+#else
+    wait_set = CreateWaitEventSet(is_session ? TopMemoryContext : CurrentMemoryContext,
+                                  nevents + 2);
+#endif
+    AddWaitEventToSet(wait_set, WL_LATCH_SET, PGINVALID_SOCKET, MyLatch, NULL);
+    AddWaitEventToSet(wait_set, WL_EXIT_ON_PM_DEATH, PGINVALID_SOCKET, NULL, NULL);
+    return wait_set;
+}
+
+/*
+ * Wait for socket events (WL_SOCKET_READABLE, WL_SOCKET_WRITEABLE) of the
+ * established connection. The socket is registered once in a set kept with
+ * the connection. Interrupts are served as soon as the latch is set. Returns
+ * the socket events occurred, 0 if the wait was woken up by the latch.
+ */
+int
+wait_plx_conn(PlxConn *plx_conn, int events)
+{
+    WaitEvent event;
+
+    if (!plx_conn->wait_set)
+    {
+        plx_conn->wait_set = create_wait_set(1, true);
+        plx_conn->wait_sock_pos = AddWaitEventToSet(plx_conn->wait_set,
+                                                    events,
+                                                    PQsocket(plx_conn->pq_conn),
+                                                    NULL,
+                                                    NULL);
+    }
+    else
+        ModifyWaitEvent(plx_conn->wait_set, plx_conn->wait_sock_pos, events, NULL);
+
+    if (WaitEventSetWait(plx_conn->wait_set, -1, &event, 1, PG_WAIT_EXTENSION) == 0)
+        return 0;
+    if (event.events & WL_LATCH_SET)
+    {
+        ResetLatch(MyLatch);
+        CHECK_FOR_INTERRUPTS();
+        return 0;
+    }
+    return event.events & WL_SOCKET_MASK;
 }
 
 PlxConn*
 get_plx_conn(PlxCluster *plx_cluster, int nnode)
 {
-    PlxConn    *plx_conn = NULL;
-    char       *raw_dsn;
-    StringInfo  dsn;
+    PlxConnSlots *slots;
+    PlxConn      *plx_conn = NULL;
+    char         *raw_dsn;
+    char         *dsn      = NULL;
 
+    if (nnode < 0 || nnode >= plx_cluster->nnodes)
+        elog(ERROR, "node %d of cluster (%s) not defined", nnode, plx_cluster->name);
     raw_dsn = plx_cluster->nodes[nnode];
-    if (!strlen(raw_dsn))
+    if (!raw_dsn)
         elog(ERROR, "node %d of cluster (%s) not defined", nnode, plx_cluster->name);
 
-    dsn = get_dsn(plx_cluster, raw_dsn);
-    /* not necessary to free dsn, bacause it created in ExprContext */
-    plx_conn = plx_conn_lookup_cache(dsn->data);
-    if (plx_conn && is_lifetime_is_over(plx_conn))
+    /* resolved connection needs neither user mapping lookup nor DSN hashing */
+    slots = get_plx_conn_slots(plx_cluster);
+    plx_conn = slots->conns[nnode];
+    if (!plx_conn)
+    {
+        dsn = get_slots_dsn(plx_cluster, slots, nnode);
+        plx_conn = plx_conn_lookup_cache(dsn);
+    }
+    /* connection left in an aborted transaction by the commit is closed */
+    if (plx_conn && plx_conn->is_commit_pending && !finish_async_commit(plx_conn))
+        plx_conn = NULL;
+    /* connection inside remote transaction or with deferred calls is used whatever */
+    if (plx_conn && (plx_conn->xlevel > 0 || plx_conn->ndeferred > 0))
+    {
+        if (!is_plx_conn_alive(plx_conn))
+        {
+            plx_node_failure(plx_cluster, nnode);
+            delete_plx_conn(plx_conn);
+            ereport(ERROR,
+                    (errcode(ERRCODE_CONNECTION_FAILURE),
+                     errmsg("connection to node %d of cluster (%s) lost inside remote transaction",
+                            nnode, plx_cluster->name)));
+        }
+        plx_conn_touch(plx_conn);
+        slots->conns[nnode] = plx_conn;
+        return plx_conn;
+    }
+    /* stale connection is replaced silently, nothing was sent over it yet */
+    if (plx_conn && (is_lifetime_is_over(plx_conn) || !is_plx_conn_alive(plx_conn)))
     {
         delete_plx_conn(plx_conn);
         plx_conn = NULL;
     }
 
+    if (!is_plx_node_available(plx_cluster, nnode, true))
+        ereport(ERROR,
+                (errcode(ERRCODE_CONNECTION_FAILURE),
+                 errmsg("node %d of cluster (%s) is unavailable",
+                        nnode, plx_cluster->name),
+                 errdetail("The node is considered down after %d consecutive connection failures.",
+                           plx_cluster->failure_threshold)));
+
     if (plx_conn)
+    {
+        plx_conn_touch(plx_conn);
+        slots->conns[nnode] = plx_conn;
         return plx_conn;
+    }
 
-    plx_conn = new_plx_conn(plx_cluster, nnode, dsn->data);
-    if (PQsetnonblocking(plx_conn->pq_conn, 1))
+    if (!dsn)
+        dsn = get_slots_dsn(plx_cluster, slots, nnode);
+    plx_conn = new_plx_conn(plx_cluster, nnode, dsn, true);
+    PG_TRY();
+    {
+        wait_for_connects(&plx_conn, 1);
+    }
+    PG_CATCH();
     {
-        char *error_message = pstrdup(PQerrorMessage(plx_conn->pq_conn));
+        delete_plx_conn(plx_conn);
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+    if (PQstatus(plx_conn->pq_conn) != CONNECTION_OK ||
+        PQsetnonblocking(plx_conn->pq_conn, 1))
+    {
+        char *error_message = pstrdup(connect_error_message(plx_conn));
 
+        plx_node_failure(plx_cluster, nnode);
         delete_plx_conn(plx_conn);
         elog(ERROR, "failed connect to '%s user=%s': %s",
             raw_dsn,
@@ -235,9 +689,43 @@ get_plx_conn(PlxCluster *plx_cluster, int nnode)
             error_message);
     }
     plx_conn_insert_cache(plx_conn);
+    /* eviction and deletion above could have reset the slots */
+    slots = get_plx_conn_slots(plx_cluster);
+    slots->conns[nnode] = plx_conn;
     return plx_conn;
 }
 
+/*
+ * Close connections which were idle longer than connection_idle_timeout
+ * of their cluster. Checked at transaction end at most once a second.
+ */
+static void
+conn_xact_callback(XactEvent event, void *arg)
+{
+    dlist_mutable_iter iter;
+    time_t             now;
+
+    if ((event != XACT_EVENT_COMMIT && event != XACT_EVENT_ABORT) ||
+        dlist_is_empty(&plx_conn_lru))
+        return;
+
+    now = time(NULL);
+    if (now == last_reap_time)
+        return;
+    last_reap_time = now;
+
+    dlist_foreach_modify(iter, &plx_conn_lru)
+    {
+        PlxConn *plx_conn     = dlist_container(PlxConn, lru_node, iter.cur);
+        int      idle_timeout = plx_conn->plx_cluster->connection_idle_timeout;
+
+        if (idle_timeout > 0 &&
+            now - plx_conn->last_used_time > idle_timeout &&
+            is_plx_conn_idle(plx_conn))
+            delete_plx_conn(plx_conn);
+    }
+}
+
 void
 drop_all_connects(void)
 {
@@ -247,7 +735,264 @@ drop_all_connects(void)
     hash_seq_init(&scan, plx_conn_cache);
     while ((entry = (PlxConnHashEntry *) hash_seq_search(&scan)))
     {
-        elog(WARNING, "plexor: drop connect %s", entry->plx_conn->dsn);
+        elog(DEBUG1, "plexor: drop connect %s", entry->plx_conn->dsn);
         delete_plx_conn(entry->plx_conn);
     }
-}
\ No newline at end of file
+}
+
+/*
+ * connect_timeout of the connection in seconds, 0 means wait forever. libpq
+ * applies it in PQconnectdb() only, so PQconnectPoll() callers do it.
+ */
+int
+get_connect_timeout(PGconn *pq_conn)
+{
+    PQconninfoOption *opts = PQconninfo(pq_conn);
+    PQconninfoOption *opt;
+    int               timeout = 0;
+
+    if (!opts)
+        return 0;
+    for (opt = opts; opt->keyword; opt++)
+        if (strcmp(opt->keyword, "connect_timeout") == 0 && opt->val)
+            timeout = atoi(opt->val);
+    PQconninfoFree(opts);
+    /* the same as libpq does, 1 second could expire too early */
+    return timeout == 1 ? 2 : Max(timeout, 0);
+}
+
+/* Error of connection that failed or didn't connect within connect_timeout */
+static const char *
+connect_error_message(PlxConn *plx_conn)
+{
+    if (PQstatus(plx_conn->pq_conn) == CONNECTION_BAD)
+        return PQerrorMessage(plx_conn->pq_conn);
+    return "timeout expired";
+}
+
+/*
+ * Drive PQconnectPoll() of all started connections until every one of them
+ * is either established, failed or timed out. Timed out connection keeps
+ * status other than CONNECTION_OK and CONNECTION_BAD.
+ */
+static void
+wait_for_connects(PlxConn **plx_conns, int nconns)
+{
+    PostgresPollingStatusType *statuses;
+    TimestampTz               *deadlines;
+    WaitEvent                 *events;
+    int                       *fd_conns;
+    int                        i;
+
+    statuses  = palloc0(sizeof(PostgresPollingStatusType) * nconns);
+    deadlines = palloc0(sizeof(TimestampTz) * nconns);
+    events    = palloc0(sizeof(WaitEvent) * (nconns + 2));
+    fd_conns  = palloc0(sizeof(int) * nconns);
+
+    /* right after PQconnectStart() libpq behaves as if polling returned writing */
+    for (i = 0; i < nconns; i++)
+    {
+        int timeout = get_connect_timeout(plx_conns[i]->pq_conn);
+
+        statuses[i] = PQstatus(plx_conns[i]->pq_conn) == CONNECTION_BAD
+                      ? PGRES_POLLING_FAILED
+                      : PGRES_POLLING_WRITING;
+        if (timeout > 0)
+            deadlines[i] = TimestampTzPlusMilliseconds(GetCurrentTimestamp(),
+                                                       timeout * 1000L);
+    }
+
+    for (;;)
+    {
+        WaitEventSet *wait_set;
+        TimestampTz   now     = GetCurrentTimestamp();
+        long          timeout = -1;
+        int           nfds    = 0;
+        int           nevents;
+
+        for (i = 0; i < nconns; i++)
+        {
+            if (statuses[i] != PGRES_POLLING_READING &&
+                statuses[i] != PGRES_POLLING_WRITING)
+                continue;
+            if (deadlines[i] > 0)
+            {
+                long remaining = TimestampDifferenceMilliseconds(now, deadlines[i]);
+
+                if (remaining <= 0)
+                {
+                    statuses[i] = PGRES_POLLING_FAILED;
+                    continue;
+                }
+                if (timeout < 0 || remaining < timeout)
+                    timeout = remaining;
+            }
+            fd_conns[nfds++] = i;
+        }
+        if (!nfds)
+            break;
+
+        /* socket may change while connecting, so the set is built each time */
+        wait_set = create_wait_set(nfds, false);
+        for (i = 0; i < nfds; i++)
+            AddWaitEventToSet(wait_set,
+                              statuses[fd_conns[i]] == PGRES_POLLING_READING
+                              ? WL_SOCKET_READABLE
+                              : WL_SOCKET_WRITEABLE,
+                              PQsocket(plx_conns[fd_conns[i]]->pq_conn),
+                              NULL,
+                              &fd_conns[i]);
+        nevents = WaitEventSetWait(wait_set, timeout, events, nfds + 2, PG_WAIT_EXTENSION);
+        FreeWaitEventSet(wait_set);
+
+        for (i = 0; i < nevents; i++)
+        {
+            if (events[i].events & WL_LATCH_SET)
+                ResetLatch(MyLatch);
+            else if (events[i].events & WL_SOCKET_MASK)
+            {
+                int nconn = *(int *) events[i].user_data;
+
+                statuses[nconn] = PQconnectPoll(plx_conns[nconn]->pq_conn);
+            }
+        }
+        CHECK_FOR_INTERRUPTS();
+    }
+    pfree(statuses);
+    pfree(deadlines);
+    pfree(events);
+    pfree(fd_conns);
+}
+
+/* Wait for the result of a query sent by warmup_plx_cluster() */
+static bool
+wait_for_warmup_result(PlxConn *plx_conn)
+{
+    PGconn        *pq_conn = plx_conn->pq_conn;
+    PGresult      *pg_result;
+    bool           is_ok   = true;
+
+    for (;;)
+    {
+        int res = PQflush(pq_conn);
+
+        if (res == -1 || !PQconsumeInput(pq_conn))
+            return false;
+        if (!res && !PQisBusy(pq_conn))
+            break;
+        wait_plx_conn(plx_conn, res
+                                ? WL_SOCKET_READABLE | WL_SOCKET_WRITEABLE
+                                : WL_SOCKET_READABLE);
+    }
+    while ((pg_result = PQgetResult(pq_conn)))
+    {
+        if (PQresultStatus(pg_result) != PGRES_TUPLES_OK)
+            is_ok = false;
+        PQclear(pg_result);
+    }
+    return is_ok;
+}
+
+/*
+ * Open connections to all nodes of the cluster in parallel, so that the
+ * following calls don't pay for connection setup. Nodes that already have
+ * a live cached connection are left as is. With is_prepare a trivial query
+ * is also sent over every connection, which makes a pooler between plexor
+ * and the node attach a server connection too. Returns the number of nodes
+ * that have a ready connection.
+ */
+int
+warmup_plx_cluster(PlxCluster *plx_cluster, bool is_prepare)
+{
+    PlxConn **plx_conns;
+    int       nconns = 0;
+    int       nready = 0;
+    int       i;
+
+    plx_conns = palloc0(sizeof(PlxConn *) * plx_cluster->nnodes);
+    for (i = 0; i < plx_cluster->nnodes; i++)
+    {
+        StringInfo  dsn;
+        PlxConn    *plx_conn;
+
+        /* nodes missing from the sparse node array are skipped */
+        if (!plx_cluster->nodes[i])
+            continue;
+        dsn = get_dsn(plx_cluster, plx_cluster->nodes[i]);
+        plx_conn = plx_conn_lookup_cache(dsn->data);
+        if (plx_conn && plx_conn->is_commit_pending && !finish_async_commit(plx_conn))
+            plx_conn = NULL;
+        if (plx_conn && (plx_conn->xlevel > 0 || !is_lifetime_is_over(plx_conn)))
+        {
+            if (!is_prepare)
+                nready++;
+            continue;
+        }
+        if (plx_conn)
+            delete_plx_conn(plx_conn);
+        /* don't wait for nodes known to be down */
+        if (!is_plx_node_available(plx_cluster, i, false))
+            continue;
+        plx_conns[nconns++] = new_plx_conn(plx_cluster, i, dsn->data, true);
+    }
+
+    wait_for_connects(plx_conns, nconns);
+
+    for (i = 0; i < nconns; i++)
+    {
+        PlxConn *plx_conn = plx_conns[i];
+
+        if (PQstatus(plx_conn->pq_conn) != CONNECTION_OK ||
+            PQsetnonblocking(plx_conn->pq_conn, 1))
+        {
+            plx_node_failure(plx_cluster, plx_conn->nnode);
+            elog(WARNING, "plexor: warmup of node %d of cluster (%s) failed: %s",
+                 plx_conn->nnode,
+                 plx_cluster->name,
+                 connect_error_message(plx_conn));
+            delete_plx_conn(plx_conn);
+            plx_conns[i] = NULL;
+            continue;
+        }
+        plx_node_success(plx_cluster, plx_conn->nnode);
+        plx_conn_insert_cache(plx_conn);
+        if (!is_prepare)
+            nready++;
+    }
+
+    if (is_prepare)
+    {
+        /* cached connections are prepared as well, they may be pooled too */
+        nconns = 0;
+        for (i = 0; i < plx_cluster->nnodes; i++)
+        {
+            StringInfo  dsn;
+            PlxConn    *plx_conn;
+
+            if (!plx_cluster->nodes[i])
+                continue;
+            dsn = get_dsn(plx_cluster, plx_cluster->nodes[i]);
+            plx_conn = plx_conn_lookup_cache(dsn->data);
+            if (plx_conn && plx_conn->xlevel == 0 &&
+                PQtransactionStatus(plx_conn->pq_conn) == PQTRANS_IDLE &&
+                PQsendQuery(plx_conn->pq_conn, "select 1"))
+                plx_conns[nconns++] = plx_conn;
+        }
+        for (i = 0; i < nconns; i++)
+        {
+            if (wait_for_warmup_result(plx_conns[i]))
+            {
+                nready++;
+                continue;
+            }
+            elog(WARNING, "plexor: warmup of node %d of cluster (%s) failed: %s",
+                 plx_conns[i]->nnode,
+                 plx_cluster->name,
+                 PQerrorMessage(plx_conns[i]->pq_conn));
+            plx_node_failure(plx_cluster, plx_conns[i]->nnode);
+            delete_plx_conn(plx_conns[i]);
+        }
+    }
+    pfree(plx_conns);
+    return nready;
+}
@@ -31,16 +31,13 @@
 #include "plexor.h"
 
 
-static int epoll_fd = -1;
-// fixme close(epoll_fd) нигде не делается;
-
-/* Initialize plexor function cache */
-void
-execute_init(void)
-{
-    if (epoll_fd == -1)
-        epoll_fd = epoll_create(1);
-}
+/*
+ * Set when the last error was raised because the connection was broken.
+ * send_remote_call() retries after such an error without a subtransaction,
+ * so it must be raised right after the connection is deleted, holding no
+ * other resources (locks, buffers, open SPI) that only abort would release.
+ */
+static bool is_conn_broken = false;
 
 void
 pg_result_error(PGresult *pg_result)
@@ -50,7 +47,20 @@ pg_result_error(PGresult *pg_result)
     const char *diag_detail   = mctx_strcpy(CurrentMemoryContext, PQresultErrorField(pg_result, PG_DIAG_MESSAGE_DETAIL));
     const char *diag_context  = mctx_strcpy(CurrentMemoryContext, PQresultErrorField(pg_result, PG_DIAG_CONTEXT));
     const char *diag_hint     = mctx_strcpy(CurrentMemoryContext, PQresultErrorField(pg_result, PG_DIAG_MESSAGE_HINT));
-    int         sqlstate;
+
+    PQclear(pg_result);
+    remote_error(diag_sqlstate, diag_primary, diag_detail, diag_hint, diag_context);
+}
+
+/* Raise error of the node, NULL fields are omitted */
+void
+remote_error(const char *diag_sqlstate,
+             const char *diag_primary,
+             const char *diag_detail,
+             const char *diag_hint,
+             const char *diag_context)
+{
+    int sqlstate;
 
     if (diag_sqlstate)
         sqlstate = MAKE_SQLSTATE(diag_sqlstate[0],
@@ -61,7 +71,6 @@ pg_result_error(PGresult *pg_result)
     else
         sqlstate = ERRCODE_CONNECTION_FAILURE;
 
-    PQclear(pg_result);
     ereport(ERROR,
             (errcode(sqlstate),
              errmsg("Remote error: %s", diag_primary),
@@ -70,37 +79,192 @@ pg_result_error(PGresult *pg_result)
              diag_context ? errcontext("Remote context: %s", diag_context) : 0));
 }
 
-static void
-wait_for_flush(PlxFn *plx_fn, PGconn *pq_conn)
+/*
+ * Error means the connection itself is unusable (or the node goes down),
+ * rather than the remote code failed.
+ */
+static bool
+is_connection_error(PlxConn *plx_conn, PGresult *pg_result)
 {
-    struct epoll_event listenev;
-    struct epoll_event event;
-    int                res;
+    const char *sqlstate;
+
+    if (PQstatus(plx_conn->pq_conn) == CONNECTION_BAD)
+        return true;
+    sqlstate = PQresultErrorField(pg_result, PG_DIAG_SQLSTATE);
+    if (!sqlstate)
+        return true;
+    /* connection exception and operator intervention (shutdown, crash) */
+    return strncmp(sqlstate, "08", 2) == 0 || strncmp(sqlstate, "57P", 3) == 0;
+}
 
-    res = PQflush(pq_conn);
-    if (!res)
-        return;
-    if (res == -1)
-        plx_error(plx_fn, "PQflush error %s", PQerrorMessage(pq_conn));
+/* Connection is broken: account node failure, drop connection and raise error */
+static void
+drop_broken_conn(PlxFn *plx_fn, PlxConn *plx_conn, const char *action)
+{
+    char *msg = pstrdup(PQerrorMessage(plx_conn->pq_conn));
 
-    listenev.events = EPOLLOUT;
-    listenev.data.fd = PQsocket(pq_conn);
+    plx_node_failure(plx_conn->plx_cluster, plx_conn->nnode);
+    delete_plx_conn(plx_conn);
+    is_conn_broken = true;
+    plx_error(plx_fn, "%s: %s", action, msg);
+}
 
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listenev.data.fd, &listenev) < 0)
-        plx_error(plx_fn, "epoll: socket adding failed");
+/*
+ * Send out the buffered query. Input is consumed while waiting, so the node
+ * blocked on sending notices doesn't block us.
+ */
+static void
+wait_for_flush(PlxFn *plx_fn, PlxConn *plx_conn)
+{
+    PGconn *pq_conn = plx_conn->pq_conn;
+    int     res;
 
-    while (res)
+    while ((res = PQflush(pq_conn)))
     {
-        CHECK_FOR_INTERRUPTS();
-        epoll_wait(epoll_fd, &event, 1, 1);
-        res = PQflush(pq_conn);
+        int events;
+
         if (res == -1)
+            drop_broken_conn(plx_fn, plx_conn, "PQflush error");
+        events = wait_plx_conn(plx_conn, WL_SOCKET_READABLE | WL_SOCKET_WRITEABLE);
+        if ((events & WL_SOCKET_READABLE) && !PQconsumeInput(pq_conn))
+            drop_broken_conn(plx_fn, plx_conn, "PQflush error");
+    }
+}
+
+#ifdef LIBPQ_HAS_PIPELINING
+/*
+ * Read out the rest of the pipeline and leave pipeline mode, so the
+ * connection is ready for the next query.
+ */
+static void
+discard_pipeline(PlxConn *plx_conn)
+{
+    PGconn *pq_conn = plx_conn->pq_conn;
+
+    plx_conn->nxact_results = 0;
+    while (!PQexitPipelineMode(pq_conn) && PQstatus(pq_conn) == CONNECTION_OK)
+    {
+        PGresult *pg_result = PQgetResult(pq_conn);
+
+        if (pg_result)
+            PQclear(pg_result);
+    }
+}
+#endif
+
+/*
+ * Read results of deferred calls sent over the connection. The first error
+ * is raised once all of them are read, so the connection stays usable.
+ */
+void
+collect_deferred_calls(PlxConn *plx_conn)
+{
+#ifdef LIBPQ_HAS_PIPELINING
+    PGconn            *pq_conn       = plx_conn->pq_conn;
+    PGresult *volatile err_pg_result = NULL;
+    volatile int       nsyncs        = 0;
+
+    PG_TRY();
+    {
+        while (nsyncs < plx_conn->ndeferred)
+        {
+            PGresult       *pg_result;
+            ExecStatusType  status;
+
+            if (!PQconsumeInput(pq_conn))
+                break;
+            if (PQisBusy(pq_conn))
+            {
+                wait_plx_conn(plx_conn, WL_SOCKET_READABLE);
+                continue;
+            }
+            /* NULL ends results of a query in the pipeline */
+            if (!(pg_result = PQgetResult(pq_conn)))
+                continue;
+            status = PQresultStatus(pg_result);
+            if (status == PGRES_PIPELINE_SYNC)
+                nsyncs++;
+            if (status == PGRES_COMMAND_OK ||
+                status == PGRES_TUPLES_OK ||
+                status == PGRES_PIPELINE_SYNC ||
+                status == PGRES_PIPELINE_ABORTED ||
+                err_pg_result)
+                PQclear(pg_result);
+            else
+                err_pg_result = pg_result;
+        }
+    }
+    PG_CATCH();
+    {
+        if (err_pg_result)
+            PQclear(err_pg_result);
+        discard_deferred_calls(plx_conn);
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+
+    if (nsyncs < plx_conn->ndeferred)
+    {
+        char       *msg         = pstrdup(PQerrorMessage(pq_conn));
+        PlxCluster *plx_cluster = plx_conn->plx_cluster;
+        int         nnode       = plx_conn->nnode;
+
+        if (err_pg_result)
+            PQclear(err_pg_result);
+        plx_node_failure(plx_conn->plx_cluster, plx_conn->nnode);
+        delete_plx_conn(plx_conn);
+        ereport(ERROR,
+                (errcode(ERRCODE_CONNECTION_FAILURE),
+                 errmsg("connection to node %d of cluster (%s) lost with deferred calls: %s",
+                        nnode, plx_cluster->name, msg)));
+    }
+    plx_conn->ndeferred = 0;
+    plx_conn->nxact_results = 0;
+    PQexitPipelineMode(pq_conn);
+    if (err_pg_result)
+        pg_result_error(err_pg_result);
+#endif
+}
+
+/*
+ * Drop results of deferred calls, used when the transaction is aborted.
+ * Results already received are read out. A connection still running the
+ * calls is closed, unless it keeps a remote transaction of an outer level,
+ * then the calls are canceled. Returns false if the connection is closed.
+ */
+bool
+discard_deferred_calls(PlxConn *plx_conn)
+{
+#ifdef LIBPQ_HAS_PIPELINING
+    PGconn *pq_conn = plx_conn->pq_conn;
+    int     nsyncs  = 0;
+
+    while (nsyncs < plx_conn->ndeferred &&
+           PQconsumeInput(pq_conn) && !PQisBusy(pq_conn))
+    {
+        PGresult *pg_result = PQgetResult(pq_conn);
+
+        if (!pg_result)
+            continue;
+        if (PQresultStatus(pg_result) == PGRES_PIPELINE_SYNC)
+            nsyncs++;
+        PQclear(pg_result);
+    }
+    if (nsyncs < plx_conn->ndeferred)
+    {
+        if (plx_conn->xlevel == 0 || GetCurrentTransactionNestLevel() == 1)
         {
-            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, listenev.data.fd, &listenev);
-            plx_error(plx_fn, "%s", PQerrorMessage(pq_conn));
+            delete_plx_conn(plx_conn);
+            return false;
         }
+        PQrequestCancel(pq_conn);
     }
-    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, listenev.data.fd, &listenev);
+    plx_conn->ndeferred = 0;
+    discard_pipeline(plx_conn);
+#else
+    plx_conn->ndeferred = 0;
+#endif
+    return true;
 }
 
 static int
@@ -112,40 +276,21 @@ is_pq_busy(PGconn *pq_conn)
 static PGresult*
 wait_for_result(PlxFn *plx_fn, PlxConn *plx_conn)
 {
-    struct epoll_event  listenev;
-    struct epoll_event  event;
     PGconn             *pq_conn   = plx_conn->pq_conn;
     PGresult           *pg_result = NULL;
-    int nfds;
-
-    listenev.events = EPOLLIN;
-    listenev.data.fd = PQsocket(pq_conn);
-
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listenev.data.fd, &listenev) < 0)
-        plx_error(plx_fn, "epoll: socket adding failed");
+    int                 is_busy   = 0;
 
     PG_TRY();
     {
-        int tmp;
-
-        while ((tmp = is_pq_busy(pq_conn)))
+        while ((is_busy = is_pq_busy(pq_conn)))
         {
-            if (tmp == -1)
-            {
-                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, listenev.data.fd, &listenev);
-                plx_error(plx_fn, "%s", PQerrorMessage(pq_conn));
-            }
-            CHECK_FOR_INTERRUPTS();
-            nfds = epoll_wait(epoll_fd, &event, 1, 10000);
-            if (nfds == -1){
-                CHECK_FOR_INTERRUPTS();
-            }
+            if (is_busy == -1)
+                break;
+            wait_plx_conn(plx_conn, WL_SOCKET_READABLE);
         }
     }
     PG_CATCH();
     {
-        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, listenev.data.fd, &listenev);
-
         if (geterrcode() == ERRCODE_QUERY_CANCELED)
             PQrequestCancel(pq_conn);
         // https://www.postgresql.org/docs/9.0/static/libpq-async.html
@@ -156,41 +301,94 @@ wait_for_result(PlxFn *plx_fn, PlxConn *plx_conn)
         while((pg_result = PQgetResult(pq_conn))) {
             PQclear(pg_result);
         }
+#ifdef LIBPQ_HAS_PIPELINING
+        discard_pipeline(plx_conn);
+#endif
         PG_RE_THROW();
     }
     PG_END_TRY();
 
-    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, listenev.data.fd, &listenev);
+    if (is_busy == -1)
+        drop_broken_conn(plx_fn, plx_conn, "failed to get result");
     return PQgetResult(pq_conn);
 }
 
 static PGresult*
 get_pg_result(PlxFn *plx_fn, PlxConn *plx_conn)
 {
-    PGresult *pg_result     = NULL;
-    PGresult *tmp_pg_result = NULL;
+    PGresult *pg_result       = NULL;
+    PGresult *err_pg_result   = NULL;
+    PGresult *tmp_pg_result   = NULL;
+    bool      is_extra_result = false;
+
+#ifdef LIBPQ_HAS_PIPELINING
+    /* results of transaction commands pipelined ahead of the query */
+    for (; plx_conn->nxact_results > 0; plx_conn->nxact_results--)
+        while ((tmp_pg_result = wait_for_result(plx_fn, plx_conn)))
+        {
+            ExecStatusType status = PQresultStatus(tmp_pg_result);
 
+            if (status != PGRES_COMMAND_OK && status != PGRES_TUPLES_OK && !err_pg_result)
+                err_pg_result = tmp_pg_result;
+            else
+                PQclear(tmp_pg_result);
+        }
+#endif
+
+    /* read all results, so the connection stays ready for the next query */
     while((tmp_pg_result = wait_for_result(plx_fn, plx_conn)))
     {
         ExecStatusType status = PQresultStatus(tmp_pg_result);
-        if (status == PGRES_TUPLES_OK)
+        if (status != PGRES_TUPLES_OK)
         {
-            if (pg_result)
-            {
-                PQclear(pg_result);
+            if (err_pg_result)
                 PQclear(tmp_pg_result);
-                plx_error(plx_fn, "second pg_result???");
-            }
             else
-                pg_result = tmp_pg_result;
+                err_pg_result = tmp_pg_result;
+        }
+        else if (pg_result)
+        {
+            PQclear(tmp_pg_result);
+            is_extra_result = true;
         }
         else
+            pg_result = tmp_pg_result;
+    }
+
+#ifdef LIBPQ_HAS_PIPELINING
+    /* pipeline sync result */
+    if (PQpipelineStatus(plx_conn->pq_conn) != PQ_PIPELINE_OFF)
+    {
+        if ((tmp_pg_result = wait_for_result(plx_fn, plx_conn)))
+            PQclear(tmp_pg_result);
+        discard_pipeline(plx_conn);
+    }
+#endif
+
+    if (err_pg_result)
+    {
+        if (pg_result)
+            PQclear(pg_result);
+        /*
+         * Remote code error keeps the connection, the aborted remote
+         * transaction or savepoint is rolled back by transaction callbacks.
+         */
+        if (is_connection_error(plx_conn, err_pg_result))
         {
-            if (pg_result)
-                PQclear(pg_result);
+            plx_node_failure(plx_conn->plx_cluster, plx_conn->nnode);
             delete_plx_conn(plx_conn);
-            pg_result_error(tmp_pg_result);
+            is_conn_broken = true;
         }
+        else
+            plx_node_success(plx_conn->plx_cluster, plx_conn->nnode);
+        pg_result_error(err_pg_result);
+    }
+
+    plx_node_success(plx_conn->plx_cluster, plx_conn->nnode);
+    if (is_extra_result)
+    {
+        PQclear(pg_result);
+        plx_error(plx_fn, "second pg_result???");
     }
     return pg_result;
 }
@@ -204,36 +402,41 @@ plx_send_query(PlxFn    *plx_fn,
                int      *arg_lens,
                int      *arg_fmts)
 {
-    if (!PQsendQueryParams(plx_conn->pq_conn,
+    if (!send_xact_cmds(plx_conn) ||
+        !PQsendQueryParams(plx_conn->pq_conn,
                            (const char *) sql,
                            nargs,
                            NULL,
                            (const char * const*) args,
                            arg_lens,
                            arg_fmts,
-                           plx_fn->is_binary))
+                           plx_fn->is_binary)
+#ifdef LIBPQ_HAS_PIPELINING
+        || (PQpipelineStatus(plx_conn->pq_conn) != PQ_PIPELINE_OFF &&
+            !PQpipelineSync(plx_conn->pq_conn))
+#endif
+        )
     {
         char *msg = pstrdup(PQerrorMessage(plx_conn->pq_conn));
+
+        plx_node_failure(plx_conn->plx_cluster, plx_conn->nnode);
         delete_plx_conn(plx_conn);
+        is_conn_broken = true;
         plx_error(plx_fn, "failed to send query %s %s", sql, msg);
     }
-    wait_for_flush(plx_fn, plx_conn->pq_conn);
+    wait_for_flush(plx_fn, plx_conn);
 }
 
 static void
-create_fn_args(PlxFn*              plx_fn,
-               FunctionCallInfo    fcinfo,
-               char             ***args,
-               int               **arg_lens,
-               int               **arg_fmts)
+encode_fn_args(PlxFn             *plx_fn,
+               FunctionCallInfo   fcinfo,
+               char             **args,
+               int               *arg_lens,
+               int               *arg_fmts)
 {
     PlxQuery  *plx_q = plx_fn->run_query;
     int        i;
 
-    (* args)     = palloc0(sizeof(char *) * plx_q->nargs);
-    (* arg_lens) = palloc0(sizeof(int)    * plx_q->nargs);
-    (* arg_fmts) = palloc0(sizeof(int)    * plx_q->nargs);
-
     if (plx_fn->is_binary)
     {
         bytea *bin;
@@ -242,9 +445,9 @@ create_fn_args(PlxFn*              plx_fn,
             int idx = plx_q->plx_fn_arg_indexes[i];
 
             bin = SendFunctionCall(&plx_fn->arg_types[idx]->send_fn, PG_GETARG_DATUM(idx));
-            (* args)[i]     = VARDATA(bin);
-            (* arg_lens)[i] = VARSIZE(bin) - VARHDRSZ;
-            (* arg_fmts)[i] = 1;
+            args[i]     = VARDATA(bin);
+            arg_lens[i] = VARSIZE(bin) - VARHDRSZ;
+            arg_fmts[i] = 1;
         }
     }
     else
@@ -254,97 +457,224 @@ create_fn_args(PlxFn*              plx_fn,
             int idx = plx_q->plx_fn_arg_indexes[i];
 
             if (PG_ARGISNULL(idx))
-                (* args)[i] = NULL;
+                args[i] = NULL;
             else
-                (* args)[i] = OutputFunctionCall(
-                    &plx_fn->arg_types[idx]->output_fn,
-                    PG_GETARG_DATUM(idx));
-            (* arg_lens)[i] = 0;
-            (* arg_fmts)[i] = 0;
+                args[i] = plx_type_output(plx_fn->arg_types[idx], PG_GETARG_DATUM(idx));
+            arg_lens[i] = 0;
+            arg_fmts[i] = 0;
         }
     }
 }
 
-static StringInfo
-get_dymanic_record_fields(PlxFn *plx_fn, FunctionCallInfo fcinfo)
+/*
+ * Encode run query parameters into the call frame of the function, its
+ * memory is reset by the next call. Nested call of the same function made
+ * by an output function uses memory of the caller.
+ */
+static void
+create_fn_args(PlxFn*              plx_fn,
+               FunctionCallInfo    fcinfo,
+               char             ***args,
+               int               **arg_lens,
+               int               **arg_fmts)
 {
-    StringInfo buf;
-    Oid        oid;
-    TupleDesc  tuple_desc;
-    int        i;
+    PlxCallFrame  *frame = plx_fn->frame;
+    int            nargs = plx_fn->run_query->nargs;
+    MemoryContext  old_ctx;
 
-    get_call_result_type(fcinfo, &oid, &tuple_desc);
-
-    buf = makeStringInfo();
-    for (i = 0; i < tuple_desc->natts; i++)
+    if (frame->is_busy)
     {
-        Form_pg_attribute a;
-        HeapTuple         type_tuple;
-        Form_pg_type      type_struct;
+        (* args)     = palloc0(sizeof(char *) * nargs);
+        (* arg_lens) = palloc0(sizeof(int)    * nargs);
+        (* arg_fmts) = palloc0(sizeof(int)    * nargs);
+        encode_fn_args(plx_fn, fcinfo, *args, *arg_lens, *arg_fmts);
+        return;
+    }
 
-        a = TupleDescAttr(tuple_desc, i);
-        type_tuple = SearchSysCache1(TYPEOID, ObjectIdGetDatum(a->atttypid));
-        if (!HeapTupleIsValid(type_tuple))
-            plx_error(plx_fn, "cache lookup failed for type %u", a->atttypid);
-        type_struct = (Form_pg_type) GETSTRUCT(type_tuple);
-        {
-            appendStringInfo(
-                buf,
-                "%s%s %s",
-                ((i > 0) ? ", " : ""),
-                quote_identifier(NameStr(a->attname)),
-                quote_identifier(NameStr(type_struct->typname)));
-        }
-        ReleaseSysCache(type_tuple);
+    MemoryContextReset(frame->mctx);
+    old_ctx = MemoryContextSwitchTo(frame->mctx);
+    frame->is_busy = true;
+    PG_TRY();
+    {
+        encode_fn_args(plx_fn, fcinfo, frame->args, frame->arg_lens, frame->arg_fmts);
     }
-    return buf;
+    PG_CATCH();
+    {
+        frame->is_busy = false;
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+    frame->is_busy = false;
+    MemoryContextSwitchTo(old_ctx);
+
+    (* args)     = frame->args;
+    (* arg_lens) = frame->arg_lens;
+    (* arg_fmts) = frame->arg_fmts;
 }
 
 static void
 prepare_execute(PlxFn              *plx_fn,
                 FunctionCallInfo    fcinfo,
-                StringInfo         *sql,
+                PlxRecordQuery     *record_query,
+                char              **sql,
                 char             ***args,
                 int               **arg_lens,
                 int               **arg_fmts)
 {
-    PlxQuery      *plx_q = plx_fn->run_query;
     create_fn_args(plx_fn, fcinfo, args, arg_lens, arg_fmts);
-    *sql = makeStringInfo();
-    if (plx_fn->is_return_untyped_record)
+    *sql = record_query ? record_query->sql : plx_fn->frame->sql;
+}
+
+static void
+remote_execute(PlxConn *plx_conn, PlxFn *plx_fn, FunctionCallInfo fcinfo, PlxRecordQuery *record_query)
+{
+    PlxQuery    *plx_q    = plx_fn->run_query;
+    char       **args     = NULL;
+    int         *arg_lens = NULL;
+    int         *arg_fmts = NULL;
+    char        *sql;
+
+    /* results of deferred calls go first */
+    if (plx_conn->ndeferred)
+        collect_deferred_calls(plx_conn);
+    /* memory is taken from the call frame of the function */
+    prepare_execute(plx_fn, fcinfo, record_query, &sql, &args, &arg_lens, &arg_fmts);
+    /* read only call joins remote transaction opened by other calls only */
+    if (!plx_fn->is_read_only || plx_conn->xlevel > 0)
+        start_transaction(plx_conn);
+    if (*plx_idempotency_key)
+        queue_idempotency_key(plx_conn);
+    plx_send_query(plx_fn, plx_conn, sql, args, plx_q->nargs, arg_lens, arg_fmts);
+}
+
+/*
+ * Run the query on the node and get its result. Idempotent function that
+ * was called outside of remote transaction is sent once more over a new
+ * connection if the first one turns out to be broken. *plx_conn is
+ * replaced with the new connection then.
+ */
+static PGresult *
+send_remote_call(PlxConn **plx_conn, PlxFn *plx_fn, FunctionCallInfo fcinfo, PlxRecordQuery *record_query)
+{
+    PlxCluster         *plx_cluster = (*plx_conn)->plx_cluster;
+    int                 nnode       = (*plx_conn)->nnode;
+    MemoryContext       mctx        = CurrentMemoryContext;
+    PGresult *volatile  pg_result   = NULL;
+    volatile bool       is_retry    = false;
+
+    if (!plx_fn->is_idempotent || (*plx_conn)->xlevel > 0)
     {
-        StringInfo buf = get_dymanic_record_fields(plx_fn, fcinfo);
-        appendStringInfo(*sql, UNTYPED_SQL_TMPL, plx_q->sql->data, buf->data);
+        remote_execute(*plx_conn, plx_fn, fcinfo, record_query);
+        return get_pg_result(plx_fn, *plx_conn);
     }
-    else
-        appendStringInfo(*sql, TYPED_SQL_TMPL, plx_q->sql->data);
+
+    is_conn_broken = false;
+    PG_TRY();
+    {
+        remote_execute(*plx_conn, plx_fn, fcinfo, record_query);
+        pg_result = get_pg_result(plx_fn, *plx_conn);
+    }
+    PG_CATCH();
+    {
+        /* broken connection is already deleted, any other error is final */
+        if (!is_conn_broken)
+            PG_RE_THROW();
+        MemoryContextSwitchTo(mctx);
+        FlushErrorState();
+        is_retry = true;
+    }
+    PG_END_TRY();
+
+    if (is_retry)
+    {
+        elog(LOG, "plexor: retry %s on node %d of cluster (%s) after connection failure",
+             plx_fn->name, nnode, plx_cluster->name);
+        *plx_conn = get_plx_conn(plx_cluster, nnode);
+        remote_execute(*plx_conn, plx_fn, fcinfo, record_query);
+        pg_result = get_pg_result(plx_fn, *plx_conn);
+    }
+    return pg_result;
+}
+
+/* Run the call within the node concurrency limit, see health.c */
+static PGresult *
+remote_call(PlxConn **plx_conn, PlxFn *plx_fn, FunctionCallInfo fcinfo, PlxRecordQuery *record_query)
+{
+    PlxCluster         *plx_cluster = (*plx_conn)->plx_cluster;
+    PGresult *volatile  pg_result   = NULL;
+    TimestampTz         start_time;
+
+    if (!plx_node_admit(plx_cluster, (*plx_conn)->nnode, &start_time))
+        return send_remote_call(plx_conn, plx_fn, fcinfo, record_query);
+
+    PG_TRY();
+    {
+        pg_result = send_remote_call(plx_conn, plx_fn, fcinfo, record_query);
+    }
+    PG_CATCH();
+    {
+        plx_node_release(plx_cluster, 0);
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+    plx_node_release(plx_cluster, start_time);
+    return pg_result;
 }
 
+#ifdef LIBPQ_HAS_PIPELINING
+/*
+ * Send void call without waiting for its result. The call takes a pipeline
+ * of its own, results are read by collect_deferred_calls() at the next
+ * synchronous call over the connection or before commit.
+ */
 static void
-remote_execute(PlxConn *plx_conn, PlxFn *plx_fn, FunctionCallInfo fcinfo)
+remote_deferred_execute(PlxConn *plx_conn, PlxFn *plx_fn, FunctionCallInfo fcinfo)
 {
     PlxQuery    *plx_q    = plx_fn->run_query;
     char       **args     = NULL;
     int         *arg_lens = NULL;
     int         *arg_fmts = NULL;
-    StringInfo   sql;
-
-    /* memory will be alloced in ExprContext - not necessary to free it */
-    prepare_execute(plx_fn, fcinfo, &sql, &args, &arg_lens, &arg_fmts);
-    start_transaction(plx_conn);
-    plx_send_query(plx_fn, plx_conn, sql->data, args, plx_q->nargs, arg_lens, arg_fmts);
+    char        *sql;
+    TimestampTz  start_time;
+
+    /* result is not waited for, so the limit only keeps it off a saturated node */
+    if (plx_node_admit(plx_conn->plx_cluster, plx_conn->nnode, &start_time))
+        plx_node_release(plx_conn->plx_cluster, 0);
+    register_deferred_call(plx_conn);
+    prepare_execute(plx_fn, fcinfo, NULL, &sql, &args, &arg_lens, &arg_fmts);
+    if (!plx_fn->is_read_only || plx_conn->xlevel > 0)
+        start_transaction(plx_conn);
+    if (*plx_idempotency_key)
+        queue_idempotency_key(plx_conn);
+    if (!PQenterPipelineMode(plx_conn->pq_conn))
+        drop_broken_conn(plx_fn, plx_conn, "failed to enter pipeline mode");
+    plx_send_query(plx_fn, plx_conn, sql, args, plx_q->nargs, arg_lens, arg_fmts);
+    /* results of pipelined transaction commands are read with the call's */
+    plx_conn->nxact_results = 0;
+    plx_conn->ndeferred++;
 }
+#endif
 
 Datum
 remote_single_execute(PlxConn *plx_conn, PlxFn *plx_fn, FunctionCallInfo fcinfo)
 {
-    PGresult *pg_result;
-    Datum     result;
+    PlxRecordQuery *record_query = NULL;
+    PGresult       *pg_result;
+    Datum           result;
 
-    remote_execute(plx_conn, plx_fn, fcinfo);
-    pg_result = get_pg_result(plx_fn, plx_conn);
+#ifdef LIBPQ_HAS_PIPELINING
+    if (plx_fn->is_deferred)
+    {
+        remote_deferred_execute(plx_conn, plx_fn, fcinfo);
+        fcinfo->isnull = true;
+        return (Datum) 0;
+    }
+#endif
+    if (plx_fn->is_return_untyped_record)
+        record_query = get_plx_record_query(plx_fn, fcinfo);
+    pg_result = remote_call(&plx_conn, plx_fn, fcinfo, record_query);
 
-    result = get_row(fcinfo, plx_fn, pg_result, 0);
+    result = get_row(fcinfo, plx_fn, record_query, pg_result, 0);
     PQclear(pg_result);
     return result;
 }
@@ -357,18 +687,288 @@ remote_retset_execute(PlxConn *plx_conn,
 {
     FuncCallContext *funcctx;
     PlxResult       *plx_result;
+    PlxRecordQuery  *record_query = NULL;
     PGresult        *pg_result;
 
-    remote_execute(plx_conn, plx_fn, fcinfo);
-
     /* funcctx is created here but for futher work see result.c:get_next_row() */
     if (is_first_call)
         funcctx = SRF_FIRSTCALL_INIT();
     else
         funcctx = SRF_PERCALL_SETUP();
 
-    pg_result = get_pg_result(plx_fn, plx_conn);
-    plx_result = new_plx_result(plx_conn, plx_fn, pg_result, funcctx->multi_call_memory_ctx);
+    if (plx_fn->is_return_untyped_record)
+        record_query = get_plx_record_query(plx_fn, fcinfo);
+    pg_result = remote_call(&plx_conn, plx_fn, fcinfo, record_query);
+    plx_result = new_plx_result(plx_conn->plx_cluster, plx_conn->nnode, plx_fn, record_query,
+                                pg_result, funcctx->multi_call_memory_ctx);
+    funcctx->user_fctx = plx_result;
+    funcctx->max_calls = PQntuples(plx_result->pg_result);
+    funcctx->call_cntr = 0;
+}
+
+/* Make the call through the multiplexer instead of a connection of the session */
+static PGresult *
+mux_call(PlxCluster *plx_cluster, int nnode, char *dsn, PlxFn *plx_fn,
+         FunctionCallInfo fcinfo, PlxRecordQuery *record_query)
+{
+    char              **args      = NULL;
+    int                *arg_lens  = NULL;
+    int                *arg_fmts  = NULL;
+    PGresult *volatile  pg_result = NULL;
+    TimestampTz         start_time;
+    char               *sql;
+
+    prepare_execute(plx_fn, fcinfo, record_query, &sql, &args, &arg_lens, &arg_fmts);
+    if (!plx_node_admit(plx_cluster, nnode, &start_time))
+        return plx_mux_call(plx_cluster, nnode, dsn, sql, plx_fn->run_query->nargs,
+                            args, arg_lens, arg_fmts, plx_fn->is_binary);
+
+    PG_TRY();
+    {
+        pg_result = plx_mux_call(plx_cluster, nnode, dsn, sql, plx_fn->run_query->nargs,
+                                 args, arg_lens, arg_fmts, plx_fn->is_binary);
+    }
+    PG_CATCH();
+    {
+        plx_node_release(plx_cluster, 0);
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+    plx_node_release(plx_cluster, start_time);
+    return pg_result;
+}
+
+Datum
+mux_single_execute(PlxCluster *plx_cluster, int nnode, char *dsn, PlxFn *plx_fn,
+                   FunctionCallInfo fcinfo)
+{
+    PlxRecordQuery *record_query = NULL;
+    PGresult       *pg_result;
+    Datum           result;
+
+    if (plx_fn->is_return_untyped_record)
+        record_query = get_plx_record_query(plx_fn, fcinfo);
+    pg_result = mux_call(plx_cluster, nnode, dsn, plx_fn, fcinfo, record_query);
+
+    result = get_row(fcinfo, plx_fn, record_query, pg_result, 0);
+    PQclear(pg_result);
+    return result;
+}
+
+void
+mux_retset_execute(PlxCluster *plx_cluster, int nnode, char *dsn, PlxFn *plx_fn,
+                   FunctionCallInfo fcinfo)
+{
+    FuncCallContext *funcctx      = SRF_FIRSTCALL_INIT();
+    PlxRecordQuery  *record_query = NULL;
+    PlxResult       *plx_result;
+    PGresult        *pg_result;
+
+    if (plx_fn->is_return_untyped_record)
+        record_query = get_plx_record_query(plx_fn, fcinfo);
+    pg_result = mux_call(plx_cluster, nnode, dsn, plx_fn, fcinfo, record_query);
+    plx_result = new_plx_result(plx_cluster, nnode, plx_fn, record_query,
+                                pg_result, funcctx->multi_call_memory_ctx);
+    funcctx->user_fctx = plx_result;
+    funcctx->max_calls = PQntuples(plx_result->pg_result);
+    funcctx->call_cntr = 0;
+}
+
+/* Parameter types of the local call, inferred by the parser like the node does */
+typedef struct LocalCallParams
+{
+    Oid *types;
+    int  ntypes;
+} LocalCallParams;
+
+static void
+local_call_parser_setup(ParseState *pstate, void *arg)
+{
+    LocalCallParams *params = (LocalCallParams *) arg;
+
+#if PG_VERSION_NUM >= 160000
+    setup_parse_variable_parameters(pstate, &params->types, &params->ntypes);
+#else
+    parse_variable_parameters(pstate, &params->types, &params->ntypes);
+#endif
+}
+
+/*
+ * Decode parameters encoded for the node with input or receive functions of
+ * the types the parser has inferred for them.
+ */
+static ParamListInfo
+decode_local_call_params(PlxFn *plx_fn, LocalCallParams *params,
+                         char **args, int *arg_lens, int *arg_fmts)
+{
+    int           nargs    = plx_fn->run_query->nargs;
+    ParamListInfo param_li = makeParamList(nargs);
+    int           i;
+
+    for (i = 0; i < nargs; i++)
+    {
+        ParamExternData *prm   = &param_li->params[i];
+        Oid              ptype = i < params->ntypes ? params->types[i] : InvalidOid;
+        Oid              func;
+        Oid              typioparam;
+
+        if (ptype == InvalidOid || ptype == UNKNOWNOID)
+            plx_error_with_errcode(plx_fn, ERRCODE_INDETERMINATE_DATATYPE,
+                                   "could not determine data type of parameter $%d", i + 1);
+        prm->ptype  = ptype;
+        prm->pflags = PARAM_FLAG_CONST;
+        prm->isnull = args[i] == NULL;
+        prm->value  = (Datum) 0;
+        if (prm->isnull)
+            continue;
+        if (arg_fmts[i])
+        {
+            StringInfoData buf;
+
+            /* receive functions expect the value zero terminated */
+            getTypeBinaryInputInfo(ptype, &func, &typioparam);
+            initStringInfo(&buf);
+            appendBinaryStringInfo(&buf, args[i], arg_lens[i]);
+            prm->value = OidReceiveFunctionCall(func, &buf, typioparam, -1);
+            if (buf.cursor != buf.len)
+                plx_error_with_errcode(plx_fn, ERRCODE_INVALID_BINARY_REPRESENTATION,
+                                       "incorrect binary data format in parameter $%d", i + 1);
+        }
+        else
+        {
+            getTypeInputInfo(ptype, &func, &typioparam);
+            prm->value = OidInputFunctionCall(func, args[i], typioparam, -1);
+        }
+    }
+    return param_li;
+}
+
+/*
+ * Run the query of the call in process via SPI, inside the current
+ * transaction. Parameters are passed untyped as they are to the node, so
+ * the same function is resolved. The result column is encoded with
+ * functions of its type into PGresult the same way the node would send it,
+ * so result conversion is shared with remote calls.
+ */
+static PGresult *
+local_call(PlxFn *plx_fn, FunctionCallInfo fcinfo, PlxRecordQuery *record_query)
+{
+    PGresult *volatile  pg_result = NULL;
+    LocalCallParams     params    = { NULL, 0 };
+    ParamListInfo       param_li;
+    SPIPlanPtr          plan;
+    PGresAttDesc        attr;
+    FmgrInfo            out_fn;
+    Oid                 func;
+    bool                is_varlena;
+    char              **args;
+    int                *arg_lens;
+    int                *arg_fmts;
+    char               *sql;
+    int                 ret;
+    int                 i;
+
+    prepare_execute(plx_fn, fcinfo, record_query, &sql, &args, &arg_lens, &arg_fmts);
+
+    if (SPI_connect() != SPI_OK_CONNECT)
+        plx_error(plx_fn, "SPI_connect failed");
+    if (!(plan = SPI_prepare_params(sql, local_call_parser_setup, &params, 0)))
+        plx_error(plx_fn, "SPI_prepare_params failed: %s", SPI_result_code_string(SPI_result));
+    param_li = decode_local_call_params(plx_fn, &params, args, arg_lens, arg_fmts);
+    ret = SPI_execute_plan_with_paramlist(plan, param_li, plx_fn->is_read_only, 0);
+    if (ret != SPI_OK_SELECT)
+        plx_error(plx_fn, "SPI_execute_plan_with_paramlist failed: %s",
+                  SPI_result_code_string(ret));
+
+    memset(&attr, 0, sizeof(attr));
+    attr.name = "";
+    attr.format = plx_fn->is_binary;
+    attr.typid = SPI_gettypeid(SPI_tuptable->tupdesc, 1);
+    attr.typlen = -1;
+    attr.atttypmod = -1;
+    if (plx_fn->is_binary)
+        getTypeBinaryOutputInfo(attr.typid, &func, &is_varlena);
+    else
+        getTypeOutputInfo(attr.typid, &func, &is_varlena);
+    fmgr_info(func, &out_fn);
+    pg_result = PQmakeEmptyPGresult(NULL, PGRES_TUPLES_OK);
+    if (!pg_result || !PQsetResultAttrs(pg_result, 1, &attr))
+    {
+        PQclear(pg_result);
+        ereport(ERROR,
+                (errcode(ERRCODE_OUT_OF_MEMORY),
+                 errmsg("out of memory")));
+    }
+
+    PG_TRY();
+    {
+        for (i = 0; i < (int) SPI_processed; i++)
+        {
+            bool   isnull;
+            Datum  value = SPI_getbinval(SPI_tuptable->vals[i], SPI_tuptable->tupdesc, 1, &isnull);
+            char  *data  = NULL;
+            int    len   = -1;
+
+            if (isnull)
+                data = NULL;
+            else if (plx_fn->is_binary)
+            {
+                bytea *bin = SendFunctionCall(&out_fn, value);
+
+                data = VARDATA(bin);
+                len  = VARSIZE(bin) - VARHDRSZ;
+            }
+            else
+            {
+                data = OutputFunctionCall(&out_fn, value);
+                len  = strlen(data);
+            }
+            if (!PQsetvalue(pg_result, i, 0, data, len))
+                ereport(ERROR,
+                        (errcode(ERRCODE_OUT_OF_MEMORY),
+                         errmsg("out of memory")));
+        }
+    }
+    PG_CATCH();
+    {
+        PQclear(pg_result);
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+    SPI_finish();
+    return pg_result;
+}
+
+Datum
+local_single_execute(PlxFn *plx_fn, FunctionCallInfo fcinfo)
+{
+    PlxRecordQuery *record_query = NULL;
+    PGresult       *pg_result;
+    Datum           result;
+
+    if (plx_fn->is_return_untyped_record)
+        record_query = get_plx_record_query(plx_fn, fcinfo);
+    pg_result = local_call(plx_fn, fcinfo, record_query);
+
+    result = get_row(fcinfo, plx_fn, record_query, pg_result, 0);
+    PQclear(pg_result);
+    return result;
+}
+
+void
+local_retset_execute(PlxCluster *plx_cluster, int nnode, PlxFn *plx_fn,
+                     FunctionCallInfo fcinfo)
+{
+    FuncCallContext *funcctx      = SRF_FIRSTCALL_INIT();
+    PlxRecordQuery  *record_query = NULL;
+    PlxResult       *plx_result;
+    PGresult        *pg_result;
+
+    if (plx_fn->is_return_untyped_record)
+        record_query = get_plx_record_query(plx_fn, fcinfo);
+    pg_result = local_call(plx_fn, fcinfo, record_query);
+    plx_result = new_plx_result(plx_cluster, nnode, plx_fn, record_query,
+                                pg_result, funcctx->multi_call_memory_ctx);
     funcctx->user_fctx = plx_result;
     funcctx->max_calls = PQntuples(plx_result->pg_result);
     funcctx->call_cntr = 0;
@@ -34,7 +34,14 @@
 /* list of all the valid configuration options to plexor cluster */
 static const char *cluster_config_options[] = {
     "connection_lifetime",
+    "connection_idle_timeout",
     "isolation_level",
+    "failure_threshold",
+    "failure_timeout",
+    "any_affinity",
+    "node_max_calls",
+    "node_target_latency",
+    "node_queue_timeout",
     NULL
 };
 
@@ -63,13 +70,22 @@ validate_isolation_level(const char *value)
 }
 
 static void
-validate_connection_lifetime(const char *value)
+validate_unsigned_option(const char *name, const char *value)
 {
     char *endptr;
 
     strtoul(value, &endptr, 10);
     if (*endptr != '\0')
-        elog(ERROR, "Plexor: invalid connection_lifetime value: %s", value);
+        elog(ERROR, "Plexor: invalid %s value: %s", name, value);
+}
+
+static void
+validate_bool_option(const char *name, const char *value)
+{
+    bool result;
+
+    if (!parse_bool(value, &result))
+        elog(ERROR, "Plexor: invalid %s value: %s", name, value);
 }
 
 static void
@@ -86,8 +102,16 @@ validate_cluster_option(const char *name, const char *value)
 
     if (pg_strcasecmp("isolation_level", name) == 0)
         validate_isolation_level(value);
-    if (pg_strcasecmp("connection_lifetime", name) == 0)
-        validate_connection_lifetime(value);
+    if (pg_strcasecmp("connection_lifetime", name) == 0 ||
+        pg_strcasecmp("connection_idle_timeout", name) == 0 ||
+        pg_strcasecmp("failure_threshold", name) == 0 ||
+        pg_strcasecmp("failure_timeout", name) == 0 ||
+        pg_strcasecmp("node_max_calls", name) == 0 ||
+        pg_strcasecmp("node_target_latency", name) == 0 ||
+        pg_strcasecmp("node_queue_timeout", name) == 0)
+        validate_unsigned_option(name, value);
+    if (pg_strcasecmp("any_affinity", name) == 0)
+        validate_bool_option(name, value);
 }
 
 /*
@@ -117,6 +141,11 @@ plexor_fdw_validator(PG_FUNCTION_ARGS)
                             (errcode(ERRCODE_SYNTAX_ERROR),
                              errmsg("Plexor: nodes must be numbered consecutively"),
                              errhint("next valid node number is %d", node_count)));
+                if (node_num >= MAX_NODES)
+                    ereport(ERROR,
+                            (errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+                             errmsg("Plexor: too many nodes, at most %d are allowed",
+                                    MAX_NODES)));
                 if (strstr(arg, "dbname") == NULL)
                     ereport(ERROR,
                             (errcode(ERRCODE_SYNTAX_ERROR),
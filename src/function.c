@@ -46,6 +46,17 @@ static MemoryContext plx_fn_mctx;
 /* Function cache */
 static HTAB *plx_fn_cache = NULL;
 
+/* Advanced on every function deletion, so pinned functions can be trusted */
+static uint64 plx_fn_generation = 0;
+
+/* Cached functions, most recently used first */
+static dlist_head plx_fn_lru = DLIST_STATIC_INIT(plx_fn_lru);
+
+/* Memory used by cached functions */
+static Size plx_fn_cache_size = 0;
+
+static void fn_xact_callback(XactEvent event, void *arg);
+
 
 void
 plx_error_with_errcode(PlxFn *plx_fn, int err_code, const char *fmt, ...)
@@ -58,20 +69,65 @@ plx_error_with_errcode(PlxFn *plx_fn, int err_code, const char *fmt, ...)
     vsnprintf(msg, sizeof(msg), fmt, ap);
     va_end(ap);
 
-    fn_name = pstrdup(plx_fn->name);
-    delete_plx_fn(plx_fn, plx_fn_lookup_cache(plx_fn->oid) ? true : false);
+    fn_name = pstrdup(plx_fn->name ? plx_fn->name : "unknown");
+    /*
+     * Compiled function survives runtime errors, only the function failed
+     * to compile is freed.
+     */
+    if (plx_fn_lookup_cache(plx_fn->oid) != plx_fn)
+        delete_plx_fn(plx_fn, false);
 
     ereport(ERROR, (errcode(err_code),
                     errmsg("Plexor function %s(): %s", fn_name, msg)));
 }
 
+static bool
+is_plx_fn_depends_on(PlxFn *plx_fn, int cacheid, uint32 hashvalue)
+{
+    int i;
+
+    if (cacheid == PROCOID)
+        return plx_fn->proc_hash == hashvalue;
+
+    for (i = 0; i < plx_fn->nargs; i++)
+        if (plx_fn->arg_types[i]->type_hash == hashvalue)
+            return true;
+    return plx_fn->ret_type && plx_fn->ret_type->type_hash == hashvalue;
+}
+
+/*
+ * Mark functions affected by pg_proc or pg_type change, they are
+ * recompiled on the next call. Zero hashvalue means a cache reset.
+ */
+static void
+fn_syscache_callback(Datum arg, int cacheid, uint32 hashvalue)
+{
+    HASH_SEQ_STATUS  scan;
+    PlxFnHashEntry  *hentry;
+
+    hash_seq_init(&scan, plx_fn_cache);
+    while ((hentry = (PlxFnHashEntry *) hash_seq_search(&scan)))
+        if (hashvalue == 0 || is_plx_fn_depends_on(hentry->plx_fn, cacheid, hashvalue))
+            hentry->plx_fn->is_valid = false;
+}
+
+#ifdef PLX_DEBUG_ALLOC
+/* Memory of compiled functions and their call frames */
+Size
+plx_fn_mem_allocated(void)
+{
+    return plx_fn_mctx ? MemoryContextMemAllocated(plx_fn_mctx, true) : 0;
+}
+#endif
+
 /* Initialize plexor function cache */
 void
 plx_fn_cache_init(void)
 {
     HASHCTL     ctl;
     int         flags;
-    int         max_funcs = 128; // fixme
+    /* initial size only, the table grows with the number of functions */
+    int         max_funcs = 128;
     MemoryContext old_ctx;
 
     /* don't allow multiple initializations */
@@ -93,6 +149,10 @@ plx_fn_cache_init(void)
     old_ctx = MemoryContextSwitchTo(plx_fn_mctx);
     plx_fn_cache = hash_create("Plexor functions cache", max_funcs, &ctl, flags);
     MemoryContextSwitchTo(old_ctx);
+
+    CacheRegisterSyscacheCallback(PROCOID, fn_syscache_callback, (Datum) 0);
+    CacheRegisterSyscacheCallback(TYPEOID, fn_syscache_callback, (Datum) 0);
+    RegisterXactCallback(fn_xact_callback, NULL);
 }
 
 /* Search for function in cache */
@@ -118,14 +178,41 @@ plx_fn_insert_cache(PlxFn *plx_fn)
     if (found)
         elog(ERROR, "plexor function '%s' is already in cache", plx_fn->name);
     hentry->plx_fn = plx_fn;
+    dlist_push_head(&plx_fn_lru, &plx_fn->lru_node);
+#if PG_VERSION_NUM >= 130000
+    plx_fn->mem_size = MemoryContextMemAllocated(plx_fn->mctx, true);
+#else
+    plx_fn->mem_size = ALLOCSET_SMALL_INITSIZE * 2;
+#endif
+    plx_fn_cache_size += plx_fn->mem_size;
 }
 
 
 /* Delete function from cache */
 static void
-plx_fn_cache_delete(Oid fn_oid)
+plx_fn_cache_delete(PlxFn *plx_fn)
 {
-    hash_search(plx_fn_cache, &fn_oid, HASH_REMOVE, NULL);
+    hash_search(plx_fn_cache, &plx_fn->oid, HASH_REMOVE, NULL);
+    dlist_delete(&plx_fn->lru_node);
+    plx_fn_cache_size -= plx_fn->mem_size;
+}
+
+/*
+ * Delete least recently used functions while the cache is over
+ * plexor.function_cache_size. Done at transaction end, when no function
+ * is running.
+ */
+static void
+fn_xact_callback(XactEvent event, void *arg)
+{
+    Size budget = (Size) plx_function_cache_size * 1024;
+
+    if ((event != XACT_EVENT_COMMIT && event != XACT_EVENT_ABORT) ||
+        plx_function_cache_size <= 0)
+        return;
+
+    while (plx_fn_cache_size > budget && !dlist_is_empty(&plx_fn_lru))
+        delete_plx_fn(dlist_tail_element(PlxFn, lru_node, &plx_fn_lru), true);
 }
 
 /*
@@ -232,11 +319,13 @@ fill_plx_fn_arg_types(PlxFn* plx_fn, HeapTuple proc_tuple)
         {
             case PROARGMODE_IN:
             case PROARGMODE_INOUT:
-                plx_types[i] = new_plx_type(types[i], plx_fn->mctx);
-                plx_names[i] = mctx_strcpy(plx_fn->mctx, names[i]);
-                plx_fn->nargs++;
-                if (plx_fn->is_binary && !OidIsValid(plx_types[i]->oid))
+                /* input arguments are kept in call order, so types are
+                   released by index below nargs on delete */
+                plx_types[plx_fn->nargs] = get_plx_type(types[i]);
+                plx_names[plx_fn->nargs] = mctx_strcpy(plx_fn->mctx, names ? names[i] : NULL);
+                if (plx_fn->is_binary && !OidIsValid(plx_types[plx_fn->nargs]->oid))
                     plx_fn->is_binary = 0;
+                plx_fn->nargs++;
                 break;
             case PROARGMODE_VARIADIC:
                 plx_error(plx_fn, "Plexor does not support variadic args");
@@ -254,21 +343,38 @@ fill_plx_fn_arg_types(PlxFn* plx_fn, HeapTuple proc_tuple)
 static void
 fill_plx_fn_ret_type(PlxFn* plx_fn, FunctionCallInfo fcinfo)
 {
-    Oid       oid;
-    TupleDesc tuple_desc;
+    Oid            oid;
+    TupleDesc      tuple_desc;
+    TypeFuncClass  type_class;
+
+    /* function compiled ahead of a call has no call site to resolve record */
+    if (fcinfo)
+        type_class = get_call_result_type(fcinfo, &oid, &tuple_desc);
+    else
+        type_class = get_func_result_type(plx_fn->oid, &oid, &tuple_desc);
 
-    switch(get_call_result_type(fcinfo, &oid, &tuple_desc))
+    switch(type_class)
     {
         case TYPEFUNC_SCALAR:
         case TYPEFUNC_COMPOSITE:
-            plx_fn->ret_type = new_plx_type(oid, plx_fn->mctx);
+            plx_fn->ret_type = get_plx_type(oid);
+            break;
+        /*
+         * Record without column definition list at the call site: the
+         * function is cached all the same, the call fails later for want of
+         * the column list and the next call site may have it.
+         */
+        case TYPEFUNC_RECORD:
+            plx_fn->ret_type = get_plx_type(RECORDOID);
+            tuple_desc = NULL;
             break;
         default:
             return;
     }
     if (plx_fn->is_binary && !OidIsValid(&plx_fn->ret_type->oid))
         plx_fn->is_binary = 0;
-    plx_fn->ret_type_mod = (oid == RECORDOID) ? tuple_desc->tdtypmod : -1;
+    plx_fn->ret_type_mod = (oid == RECORDOID && tuple_desc) ? tuple_desc->tdtypmod : -1;
+    plx_fn->ret_natts = (oid == RECORDOID && tuple_desc) ? tuple_desc->natts : 0;
     plx_fn->is_return_void = oid == VOIDOID;
 }
 
@@ -286,11 +392,46 @@ parse_plx_fn(PlxFn *plx_fn, HeapTuple proc_tuple)
     parse(plx_fn, VARDATA_ANY(src_detoast), VARSIZE_ANY_EXHDR(src_detoast));
 }
 
+static void
+fill_plx_fn_frame(PlxFn *plx_fn)
+{
+    PlxCallFrame  *frame;
+    int            nargs = plx_fn->run_query->nargs;
+    StringInfoData sql;
+
+    frame = MemoryContextAllocZero(plx_fn->mctx, sizeof(PlxCallFrame));
+    frame->args     = MemoryContextAllocZero(plx_fn->mctx, sizeof(char *) * nargs);
+    frame->arg_lens = MemoryContextAllocZero(plx_fn->mctx, sizeof(int)    * nargs);
+    frame->arg_fmts = MemoryContextAllocZero(plx_fn->mctx, sizeof(int)    * nargs);
+    if (!plx_fn->is_return_untyped_record)
+    {
+        initStringInfo(&sql);
+        appendStringInfo(&sql, TYPED_SQL_TMPL, plx_fn->run_query->sql->data);
+        frame->sql = mctx_strcpy(plx_fn->mctx, sql.data);
+        pfree(sql.data);
+    }
+    frame->mctx = AllocSetContextCreate(plx_fn->mctx,
+                                        "Plexor call context",
+                                        ALLOCSET_SMALL_MINSIZE,
+                                        ALLOCSET_SMALL_INITSIZE,
+                                        ALLOCSET_DEFAULT_MAXSIZE);
+    plx_fn->frame = frame;
+}
+
+/* Every function has own memory context, it is deleted with the function */
 static PlxFn *
 new_plx_fn()
 {
-    PlxFn *plx_fn = MemoryContextAllocZero(plx_fn_mctx, sizeof(PlxFn));
-    plx_fn->mctx = plx_fn_mctx;
+    MemoryContext  mctx;
+    PlxFn         *plx_fn;
+
+    mctx = AllocSetContextCreate(plx_fn_mctx,
+                                 "Plexor function context",
+                                 ALLOCSET_SMALL_MINSIZE,
+                                 ALLOCSET_SMALL_INITSIZE,
+                                 ALLOCSET_SMALL_MAXSIZE);
+    plx_fn = MemoryContextAllocZero(mctx, sizeof(PlxFn));
+    plx_fn->mctx = mctx;
     return plx_fn;
 }
 
@@ -306,9 +447,17 @@ compile_plx_fn(FunctionCallInfo fcinfo, HeapTuple proc_tuple, bool is_validate)
 
     plx_fn = new_plx_fn();
     plx_fn->oid = proc_struct->oid;
+    plx_fn->proc_hash = GetSysCacheHashValue1(PROCOID, ObjectIdGetDatum(plx_fn->oid));
+    plx_fn->is_valid = true;
     fill_plx_fn_name(plx_fn, proc_struct);
+    MemoryContextSetIdentifier(plx_fn->mctx, plx_fn->name);
     fill_plx_fn_arg_types(plx_fn, proc_tuple);
     parse_plx_fn(plx_fn, proc_tuple);
+    if (plx_fn->is_deferred &&
+        (proc_struct->prorettype != VOIDOID || proc_struct->proretset))
+        plx_syntax_error(plx_fn, "deferred function must return void");
+    if (plx_fn->is_deferred && plx_fn->run_on == RUN_ON_ALL_COALESCE)
+        plx_syntax_error(plx_fn, "deferred function can't run on all coalesce");
 
     if (is_validate)
         return plx_fn;
@@ -318,78 +467,196 @@ compile_plx_fn(FunctionCallInfo fcinfo, HeapTuple proc_tuple, bool is_validate)
     if (!plx_fn->run_query)
         plx_fn->run_query = create_plx_query_from_plx_fn(plx_fn);
     fill_plx_fn_ret_type(plx_fn, fcinfo);
-    plx_set_stamp(&plx_fn->stamp, proc_tuple);
+    fill_plx_fn_frame(plx_fn);
     return plx_fn;
 }
 
-static bool
-is_plx_fn_todate(PlxFn *plx_fn, HeapTuple proc_tuple)
-{
-    int i;
-
-    if (!plx_check_stamp(&(plx_fn->stamp), proc_tuple))
-        return false;
-    for (i = 0; i < plx_fn->nargs; i++)
-        if (!is_plx_type_todate(plx_fn->arg_types[i]))
-            return false;
-    if (!is_plx_type_todate(plx_fn->ret_type))
-        return false;
-    return true;
-}
-
 void
 delete_plx_fn(PlxFn *plx_fn, bool is_cache_delete)
 {
     int i;
 
-    if (plx_fn->name)
-        pfree(plx_fn->name);
-    if (plx_fn->cluster_name)
-        pfree(plx_fn->cluster_name);
-    if (plx_fn->hash_query)
-        delete_plx_query(plx_fn->hash_query);
-    if (plx_fn->run_query)
-        delete_plx_query(plx_fn->run_query);
-    if (plx_fn->arg_types)
-    {
-        for (i = 0; i < plx_fn->nargs; i++)
-            pfree(plx_fn->arg_types[i]);
-        pfree(plx_fn->arg_types);
-    }
-    if (plx_fn->arg_names)
-    {
-        for (i = 0; i < plx_fn->nargs; i++)
-            pfree(plx_fn->arg_names[i]);
-        pfree(plx_fn->arg_names);
-    }
+    plx_fn_generation++;
+    /* types are shared, everything else is in the function context */
+    for (i = 0; i < plx_fn->nargs; i++)
+        release_plx_type(plx_fn->arg_types[i]);
     if (plx_fn->ret_type)
-        pfree(plx_fn->ret_type);
+        release_plx_type(plx_fn->ret_type);
     if (is_cache_delete)
-        plx_fn_cache_delete(plx_fn->oid);
-    pfree(plx_fn);
+        plx_fn_cache_delete(plx_fn);
+    MemoryContextDelete(plx_fn->mctx);
 }
 
+/*
+ * Get compiled function. Up to date function is found without catalog
+ * lookups: in fn_extra of the call site or in the function cache.
+ * Set-returning functions keep FuncCallContext in fn_extra, so they
+ * always use the cache.
+ */
 PlxFn *
 get_plx_fn(FunctionCallInfo fcinfo)
 {
-    HeapTuple  proc_tuple;
-    PlxFn     *plx_fn = plx_fn_lookup_cache(fcinfo->flinfo->fn_oid);
+    FmgrInfo   *flinfo = fcinfo->flinfo;
+    PlxFnExtra *extra  = NULL;
+    HeapTuple   proc_tuple;
+    PlxFn      *plx_fn;
 
-    proc_tuple = SearchSysCache1(PROCOID, ObjectIdGetDatum(fcinfo->flinfo->fn_oid));
-    if (!HeapTupleIsValid(proc_tuple))
-        elog(ERROR, "cache lookup failed for function %u", fcinfo->flinfo->fn_oid);
+    if (!flinfo->fn_retset)
+    {
+        extra = (PlxFnExtra *) flinfo->fn_extra;
+        if (extra && extra->generation == plx_fn_generation && extra->plx_fn->is_valid)
+        {
+            dlist_move_head(&plx_fn_lru, &extra->plx_fn->lru_node);
+            return extra->plx_fn;
+        }
+    }
 
-    if (plx_fn && !is_plx_fn_todate(plx_fn, proc_tuple))
+    plx_fn = plx_fn_lookup_cache(flinfo->fn_oid);
+    if (plx_fn && !plx_fn->is_valid)
     {
         delete_plx_fn(plx_fn, true);
         plx_fn = NULL;
     }
+    else if (plx_fn)
+        dlist_move_head(&plx_fn_lru, &plx_fn->lru_node);
 
     if (!plx_fn)
     {
+        proc_tuple = SearchSysCache1(PROCOID, ObjectIdGetDatum(flinfo->fn_oid));
+        if (!HeapTupleIsValid(proc_tuple))
+            elog(ERROR, "cache lookup failed for function %u", flinfo->fn_oid);
         plx_fn = compile_plx_fn(fcinfo, proc_tuple, false);
+        ReleaseSysCache(proc_tuple);
         plx_fn_insert_cache(plx_fn);
     }
-    ReleaseSysCache(proc_tuple);
+
+    if (!flinfo->fn_retset)
+    {
+        if (!extra)
+        {
+            extra = MemoryContextAlloc(flinfo->fn_mcxt, sizeof(PlxFnExtra));
+            flinfo->fn_extra = extra;
+        }
+        extra->plx_fn = plx_fn;
+        extra->generation = plx_fn_generation;
+        extra->record_query = NULL;
+    }
     return plx_fn;
 }
+
+static char *
+get_record_fields(PlxFn *plx_fn, TupleDesc tuple_desc)
+{
+    StringInfoData buf;
+    int            i;
+
+    initStringInfo(&buf);
+    for (i = 0; i < tuple_desc->natts; i++)
+    {
+        Form_pg_attribute a;
+        HeapTuple         type_tuple;
+        Form_pg_type      type_struct;
+
+        a = TupleDescAttr(tuple_desc, i);
+        type_tuple = SearchSysCache1(TYPEOID, ObjectIdGetDatum(a->atttypid));
+        if (!HeapTupleIsValid(type_tuple))
+            plx_error(plx_fn, "cache lookup failed for type %u", a->atttypid);
+        type_struct = (Form_pg_type) GETSTRUCT(type_tuple);
+        appendStringInfo(&buf,
+                         "%s%s %s",
+                         ((i > 0) ? ", " : ""),
+                         quote_identifier(NameStr(a->attname)),
+                         quote_identifier(NameStr(type_struct->typname)));
+        ReleaseSysCache(type_tuple);
+    }
+    return buf.data;
+}
+
+/*
+ * Get remote query of untyped record function for the column definition
+ * list of the call site. The query is built once per column list, blessed
+ * typmod identifies the list. Call site of a function that doesn't return
+ * set keeps the query in fn_extra, so no lookup is done at all.
+ */
+PlxRecordQuery *
+get_plx_record_query(PlxFn *plx_fn, FunctionCallInfo fcinfo)
+{
+    PlxFnExtra     *extra = NULL;
+    PlxRecordQuery *record_query;
+    TupleDesc       tuple_desc;
+    Oid             oid;
+    char           *fields;
+
+    if (!fcinfo->flinfo->fn_retset)
+    {
+        extra = (PlxFnExtra *) fcinfo->flinfo->fn_extra;
+        if (extra->record_query)
+            return extra->record_query;
+    }
+
+    if (get_call_result_type(fcinfo, &oid, &tuple_desc) != TYPEFUNC_COMPOSITE)
+        plx_error(plx_fn, "function returning record called in context "
+                          "that cannot accept type record");
+
+    for (record_query = plx_fn->record_queries; record_query; record_query = record_query->next)
+        if (record_query->type_mod == tuple_desc->tdtypmod)
+            break;
+
+    if (!record_query)
+    {
+        StringInfoData sql;
+
+        fields = get_record_fields(plx_fn, tuple_desc);
+        initStringInfo(&sql);
+        appendStringInfo(&sql, UNTYPED_SQL_TMPL, plx_fn->run_query->sql->data, fields);
+
+        record_query = MemoryContextAllocZero(plx_fn->mctx, sizeof(PlxRecordQuery));
+        record_query->type_mod = tuple_desc->tdtypmod;
+        record_query->natts = tuple_desc->natts;
+        record_query->sql = mctx_strcpy(plx_fn->mctx, sql.data);
+        record_query->next = plx_fn->record_queries;
+        plx_fn->record_queries = record_query;
+    }
+
+    if (extra)
+        extra->record_query = record_query;
+    return record_query;
+}
+
+/*
+ * Compile function into the cache ahead of its first call. Result and
+ * arguments of polymorphic function depend on the call site, such function
+ * is left to be compiled by the call.
+ */
+bool
+precompile_plx_fn(Oid fn_oid)
+{
+    HeapTuple     proc_tuple;
+    Form_pg_proc  proc_struct;
+    PlxFn        *plx_fn = plx_fn_lookup_cache(fn_oid);
+    int           i;
+
+    if (plx_fn && plx_fn->is_valid)
+        return true;
+
+    proc_tuple = SearchSysCache1(PROCOID, ObjectIdGetDatum(fn_oid));
+    if (!HeapTupleIsValid(proc_tuple))
+        elog(ERROR, "cache lookup failed for function %u", fn_oid);
+    proc_struct = (Form_pg_proc) GETSTRUCT(proc_tuple);
+
+    for (i = 0; i < proc_struct->proargtypes.dim1; i++)
+        if (IsPolymorphicType(proc_struct->proargtypes.values[i]))
+            break;
+    if (i < proc_struct->proargtypes.dim1 || IsPolymorphicType(proc_struct->prorettype))
+    {
+        ReleaseSysCache(proc_tuple);
+        return false;
+    }
+
+    if (plx_fn)
+        delete_plx_fn(plx_fn, true);
+    plx_fn = compile_plx_fn(NULL, proc_tuple, false);
+    ReleaseSysCache(proc_tuple);
+    plx_fn_insert_cache(plx_fn);
+    return true;
+}
@@ -0,0 +1,500 @@
+/*
+ * Copyright (c) 2015, Dima Beloborodov, Andrey Chernyakov, (CoMagic, UIS)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *    This product includes software developed by the <organization>.
+ * 4. Neither the name of the <organization> nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "plexor.h"
+
+
+/*
+ * Node health registry. Every backend reports connection failures and
+ * successes of the nodes to a table in shared memory, so when a node goes
+ * down, only the first backends wait for timeouts and the rest fail
+ * immediately (circuit breaker). After failure_timeout seconds a single
+ * backend is allowed to probe the node; on success the node is healthy again.
+ *
+ * The registry also limits calls to a node from all backends at once to
+ * node_max_calls of the cluster (admission control). With
+ * node_target_latency the limit adapts: a call slower than the target
+ * halves it, a run of fast calls as long as the limit raises it by one.
+ *
+ * The registry works only if plexor is in shared_preload_libraries,
+ * otherwise all nodes are always available.
+ */
+
+#define MAX_ADMITTED_CALLS 64                /* nested calls tracked by a backend */
+#define ADMISSION_POLL_INTERVAL 10           /* ms between admission checks       */
+
+typedef struct PlxHealthShared
+{
+    LWLock *lock;                            /* protects plx_health_hash */
+} PlxHealthShared;
+
+static PlxHealthShared *plx_health_shared = NULL;
+
+/* Node health hash in shared memory */
+static HTAB *plx_health_hash = NULL;
+
+/* Nodes the calls of the backend were admitted to, innermost call last */
+static PlxNodeHealth *admitted[MAX_ADMITTED_CALLS];
+static int            nadmitted = 0;
+
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+PG_FUNCTION_INFO_V1(plexor_node_status);
+
+
+static Size
+plx_health_shmem_size(void)
+{
+    return add_size(MAXALIGN(sizeof(PlxHealthShared)),
+                    hash_estimate_size(plx_max_tracked_nodes, sizeof(PlxNodeHealth)));
+}
+
+static void
+plx_health_shmem_request(void)
+{
+#if PG_VERSION_NUM >= 150000
+    if (prev_shmem_request_hook)
+        prev_shmem_request_hook();
+#endif
+    RequestAddinShmemSpace(plx_health_shmem_size());
+    RequestNamedLWLockTranche("plexor", 1);
+}
+
+static void
+plx_health_shmem_startup(void)
+{
+    HASHCTL ctl;
+    bool    found;
+
+    if (prev_shmem_startup_hook)
+        prev_shmem_startup_hook();
+
+    LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+    plx_health_shared = ShmemInitStruct("Plexor node health",
+                                        sizeof(PlxHealthShared),
+                                        &found);
+    if (!found)
+        plx_health_shared->lock = &(GetNamedLWLockTranche("plexor"))->lock;
+
+    MemSet(&ctl, 0, sizeof(ctl));
+    ctl.keysize = sizeof(PlxNodeKey);
+    ctl.entrysize = sizeof(PlxNodeHealth);
+    plx_health_hash = ShmemInitHash("Plexor node health hash",
+                                    plx_max_tracked_nodes,
+                                    plx_max_tracked_nodes,
+                                    &ctl,
+                                    HASH_ELEM | HASH_BLOBS);
+    LWLockRelease(AddinShmemInitLock);
+}
+
+/* Install shared memory hooks, called from _PG_init() */
+void
+plx_health_init(void)
+{
+    if (!process_shared_preload_libraries_in_progress)
+        return;
+
+#if PG_VERSION_NUM >= 150000
+    prev_shmem_request_hook = shmem_request_hook;
+    shmem_request_hook = plx_health_shmem_request;
+#else
+    plx_health_shmem_request();
+#endif
+    prev_shmem_startup_hook = shmem_startup_hook;
+    shmem_startup_hook = plx_health_shmem_startup;
+}
+
+/*
+ * Find node health in shared memory, create it on first use. Entries are
+ * never removed, so the pointer is kept in the cluster.
+ */
+static PlxNodeHealth *
+get_plx_node_health(PlxCluster *plx_cluster, int nnode)
+{
+    PlxNodeHealth *health;
+    PlxNodeKey     key;
+    bool           found;
+
+    /* node of a connection may be gone after ALTER SERVER */
+    if (!plx_health_hash || nnode >= plx_cluster->nnodes)
+        return NULL;
+    if (plx_cluster->node_health[nnode])
+        return plx_cluster->node_health[nnode];
+
+    MemSet(&key, 0, sizeof(key));
+    key.server_oid = plx_cluster->oid;
+    key.nnode = nnode;
+
+    LWLockAcquire(plx_health_shared->lock, LW_SHARED);
+    health = hash_search(plx_health_hash, &key, HASH_FIND, NULL);
+    LWLockRelease(plx_health_shared->lock);
+
+    if (!health)
+    {
+        LWLockAcquire(plx_health_shared->lock, LW_EXCLUSIVE);
+        /* NULL if registry is full, node is not tracked then */
+        health = hash_search(plx_health_hash, &key, HASH_ENTER_NULL, &found);
+        if (health && !found)
+        {
+            SpinLockInit(&health->mutex);
+            health->state = PLX_NODE_CLOSED;
+            health->nfailures = 0;
+            health->last_failure_time = 0;
+            health->probe_pid = 0;
+            health->probe_start_time = 0;
+            health->ncalls = 0;
+            health->call_limit = 0;
+            health->nqueued = 0;
+            health->nlimit_calls = 0;
+            health->limit_decrease_time = 0;
+        }
+        LWLockRelease(plx_health_shared->lock);
+    }
+    plx_cluster->node_health[nnode] = health;
+    return health;
+}
+
+/*
+ * Check if calls to the node are allowed. With is_probe the caller takes
+ * the right to probe a node which has been down for failure_timeout.
+ */
+bool
+is_plx_node_available(PlxCluster *plx_cluster, int nnode, bool is_probe)
+{
+    PlxNodeHealth *health = get_plx_node_health(plx_cluster, nnode);
+    int            timeout_ms;
+    TimestampTz    now;
+    bool           is_available = false;
+
+    /* state is read without lock, it is only a hint for the healthy node */
+    if (!health || plx_cluster->failure_threshold <= 0 || health->state == PLX_NODE_CLOSED)
+        return true;
+
+    timeout_ms = plx_cluster->failure_timeout * 1000;
+    now = GetCurrentTimestamp();
+
+    SpinLockAcquire(&health->mutex);
+    switch (health->state)
+    {
+        case PLX_NODE_CLOSED:
+            is_available = true;
+            break;
+        case PLX_NODE_OPEN:
+            if (TimestampDifferenceExceeds(health->last_failure_time, now, timeout_ms))
+            {
+                is_available = true;
+                if (is_probe)
+                {
+                    health->state = PLX_NODE_HALF_OPEN;
+                    health->probe_pid = MyProcPid;
+                    health->probe_start_time = now;
+                }
+            }
+            break;
+        case PLX_NODE_HALF_OPEN:
+            if (health->probe_pid == MyProcPid)
+                is_available = true;
+            /* probe seems to be lost, let another backend try */
+            else if (TimestampDifferenceExceeds(health->probe_start_time, now, timeout_ms))
+            {
+                is_available = true;
+                if (is_probe)
+                {
+                    health->probe_pid = MyProcPid;
+                    health->probe_start_time = now;
+                }
+            }
+            break;
+    }
+    SpinLockRelease(&health->mutex);
+    return is_available;
+}
+
+/* Account connection level failure of the node */
+void
+plx_node_failure(PlxCluster *plx_cluster, int nnode)
+{
+    PlxNodeHealth *health = get_plx_node_health(plx_cluster, nnode);
+    TimestampTz    now;
+
+    if (!health || plx_cluster->failure_threshold <= 0)
+        return;
+
+    now = GetCurrentTimestamp();
+    SpinLockAcquire(&health->mutex);
+    health->nfailures++;
+    health->last_failure_time = now;
+    if (health->state == PLX_NODE_HALF_OPEN ||
+        health->nfailures >= plx_cluster->failure_threshold)
+    {
+        health->state = PLX_NODE_OPEN;
+        health->probe_pid = 0;
+    }
+    SpinLockRelease(&health->mutex);
+}
+
+/* Node answered, so it is healthy */
+void
+plx_node_success(PlxCluster *plx_cluster, int nnode)
+{
+    PlxNodeHealth *health = get_plx_node_health(plx_cluster, nnode);
+
+    if (!health || (health->state == PLX_NODE_CLOSED && !health->nfailures))
+        return;
+
+    SpinLockAcquire(&health->mutex);
+    health->state = PLX_NODE_CLOSED;
+    health->nfailures = 0;
+    health->probe_pid = 0;
+    SpinLockRelease(&health->mutex);
+}
+
+/* Current limit of the node, must be called under mutex */
+static int
+get_call_limit(PlxNodeHealth *health, PlxCluster *plx_cluster)
+{
+    if (health->call_limit <= 0 ||
+        health->call_limit > plx_cluster->node_max_calls ||
+        plx_cluster->node_target_latency <= 0)
+        health->call_limit = plx_cluster->node_max_calls;
+    return health->call_limit;
+}
+
+static void
+dequeue_call(PlxNodeHealth *health)
+{
+    SpinLockAcquire(&health->mutex);
+    health->nqueued--;
+    SpinLockRelease(&health->mutex);
+}
+
+/*
+ * Take a call slot of the node. A saturated node fails the call at once,
+ * or after node_queue_timeout the call has waited for a free slot. Returns
+ * false if calls to the node are not limited, otherwise the slot must be
+ * given back by plx_node_release().
+ */
+bool
+plx_node_admit(PlxCluster *plx_cluster, int nnode, TimestampTz *start_time)
+{
+    PlxNodeHealth *health;
+    TimestampTz    deadline  = 0;
+    bool           is_queued = false;
+    int            limit;
+
+    if (plx_cluster->node_max_calls <= 0 ||
+        nadmitted >= MAX_ADMITTED_CALLS ||
+        !(health = get_plx_node_health(plx_cluster, nnode)))
+        return false;
+
+    for (;;)
+    {
+        bool is_admitted;
+
+        SpinLockAcquire(&health->mutex);
+        limit = get_call_limit(health, plx_cluster);
+        is_admitted = health->ncalls < limit;
+        if (is_admitted)
+        {
+            health->ncalls++;
+            if (is_queued)
+                health->nqueued--;
+        }
+        else if (!is_queued && plx_cluster->node_queue_timeout > 0)
+        {
+            health->nqueued++;
+            is_queued = true;
+        }
+        SpinLockRelease(&health->mutex);
+        if (is_admitted)
+            break;
+
+        if (!deadline && is_queued)
+            deadline = TimestampTzPlusMilliseconds(GetCurrentTimestamp(),
+                                                   plx_cluster->node_queue_timeout);
+        else if (!is_queued || GetCurrentTimestamp() >= deadline)
+        {
+            if (is_queued)
+                dequeue_call(health);
+            ereport(ERROR,
+                    (errcode(ERRCODE_CONFIGURATION_LIMIT_EXCEEDED),
+                     errmsg("node %d of cluster (%s) is saturated",
+                            nnode, plx_cluster->name),
+                     errdetail("%d calls to the node are in progress.", limit)));
+        }
+
+        PG_TRY();
+        {
+            (void) WaitLatch(MyLatch,
+                             WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+                             ADMISSION_POLL_INTERVAL,
+                             PG_WAIT_EXTENSION);
+            ResetLatch(MyLatch);
+            CHECK_FOR_INTERRUPTS();
+        }
+        PG_CATCH();
+        {
+            dequeue_call(health);
+            PG_RE_THROW();
+        }
+        PG_END_TRY();
+    }
+
+    admitted[nadmitted++] = health;
+    *start_time = plx_cluster->node_target_latency > 0 ? GetCurrentTimestamp() : 0;
+    return true;
+}
+
+/*
+ * Give back the slot of the innermost admitted call. Latency of the call
+ * adapts the limit, start_time 0 means the call failed and is not counted.
+ */
+void
+plx_node_release(PlxCluster *plx_cluster, TimestampTz start_time)
+{
+    PlxNodeHealth *health = admitted[--nadmitted];
+    int            target = plx_cluster->node_target_latency;
+    TimestampTz    now    = start_time ? GetCurrentTimestamp() : 0;
+
+    SpinLockAcquire(&health->mutex);
+    health->ncalls--;
+    if (start_time && target > 0)
+    {
+        int limit = get_call_limit(health, plx_cluster);
+
+        if (TimestampDifferenceExceeds(start_time, now, target))
+        {
+            /* once per target latency, calls in progress were slow as well */
+            if (TimestampDifferenceExceeds(health->limit_decrease_time, now, target))
+            {
+                health->call_limit = Max(1, limit / 2);
+                health->limit_decrease_time = now;
+            }
+            health->nlimit_calls = 0;
+        }
+        else if (++health->nlimit_calls >= limit)
+        {
+            health->call_limit = Min(plx_cluster->node_max_calls, limit + 1);
+            health->nlimit_calls = 0;
+        }
+    }
+    SpinLockRelease(&health->mutex);
+}
+
+/* Give back slots of calls interrupted by the backend exit */
+void
+plx_node_release_all(void)
+{
+    while (nadmitted > 0)
+    {
+        PlxNodeHealth *health = admitted[--nadmitted];
+
+        SpinLockAcquire(&health->mutex);
+        health->ncalls--;
+        SpinLockRelease(&health->mutex);
+    }
+}
+
+static const char *
+node_state_name(PlxNodeState state)
+{
+    switch (state)
+    {
+        case PLX_NODE_CLOSED:
+            return "closed";
+        case PLX_NODE_OPEN:
+            return "open";
+        case PLX_NODE_HALF_OPEN:
+            return "half open";
+    }
+    return "unknown";
+}
+
+/*
+ * Show the node health registry
+ */
+Datum
+plexor_node_status(PG_FUNCTION_ARGS)
+{
+    ReturnSetInfo   *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    TupleDesc        tuple_desc;
+    Tuplestorestate *tupstore;
+    HASH_SEQ_STATUS  scan;
+    PlxNodeHealth   *entry;
+    MemoryContext    old_ctx;
+
+    if (!rsinfo || !(rsinfo->allowedModes & SFRM_Materialize))
+        elog(ERROR, "plexor_node_status: materialize mode required");
+
+    old_ctx = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+    if (get_call_result_type(fcinfo, NULL, &tuple_desc) != TYPEFUNC_COMPOSITE)
+        elog(ERROR, "plexor_node_status: return type must be a row type");
+    tupstore = tuplestore_begin_heap(true, false, work_mem);
+    rsinfo->returnMode = SFRM_Materialize;
+    rsinfo->setResult = tupstore;
+    rsinfo->setDesc = tuple_desc;
+    MemoryContextSwitchTo(old_ctx);
+
+    if (!plx_health_hash)
+        return (Datum) 0;
+
+    LWLockAcquire(plx_health_shared->lock, LW_SHARED);
+    hash_seq_init(&scan, plx_health_hash);
+    while ((entry = (PlxNodeHealth *) hash_seq_search(&scan)))
+    {
+        PlxNodeHealth health;
+        Datum         values[8];
+        bool          nulls[8];
+
+        SpinLockAcquire(&entry->mutex);
+        health = *entry;
+        SpinLockRelease(&entry->mutex);
+
+        MemSet(nulls, 0, sizeof(nulls));
+        values[0] = ObjectIdGetDatum(health.key.server_oid);
+        values[1] = Int32GetDatum(health.key.nnode);
+        values[2] = CStringGetTextDatum(node_state_name(health.state));
+        values[3] = Int32GetDatum(health.nfailures);
+        if (health.last_failure_time)
+            values[4] = TimestampTzGetDatum(health.last_failure_time);
+        else
+            nulls[4] = true;
+        values[5] = Int32GetDatum(health.ncalls);
+        values[6] = Int32GetDatum(health.call_limit);
+        values[7] = Int32GetDatum(health.nqueued);
+        tuplestore_putvalues(tupstore, tuple_desc, values, nulls);
+    }
+    LWLockRelease(plx_health_shared->lock);
+
+    return (Datum) 0;
+}
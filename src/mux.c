@@ -0,0 +1,1069 @@
+/*
+ * Copyright (c) 2015, Dima Beloborodov, Andrey Chernyakov, (CoMagic, UIS)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *    This product includes software developed by the <organization>.
+ * 4. Neither the name of the <organization> nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "plexor.h"
+
+
+/*
+ * Connection multiplexer. Calls which need no remote transaction are handed
+ * by backends to plexor.multiplexer_workers background workers, so nodes see
+ * a connection per worker and DSN instead of a connection per backend.
+ *
+ * A backend takes a slot on the first such call and creates a DSM segment
+ * with a request and a response shm_mq. Slot n is served by worker
+ * n % plexor.multiplexer_workers, the worker sends calls of all its backends
+ * to a node over one pipelined connection and passes results back in order.
+ * Calls inside remote transactions, deferred calls and calls with an
+ * idempotency key keep using connections of the session.
+ *
+ * The multiplexer works only if plexor is in shared_preload_libraries and
+ * libpq supports pipelining.
+ */
+
+#define PLX_MUX_QUEUE_SIZE 65536             /* bytes in each queue of a slot */
+
+typedef struct PlxMuxClient
+{
+    pid_t           pid;                     /* backend the slot is taken by or 0     */
+    dsm_handle      handle;                  /* segment with the queues of the slot   */
+    uint64          generation;              /* changed when the slot changes owner   */
+} PlxMuxClient;
+
+typedef struct PlxMuxShared
+{
+    slock_t         mutex;                   /* protects fields below                 */
+    Latch          *latches[MAX_MUX_WORKERS];/* latches of running workers            */
+    int             nclients;                /* clients array size                    */
+    PlxMuxClient    clients[FLEXIBLE_ARRAY_MEMBER];
+} PlxMuxShared;
+
+static PlxMuxShared *plx_mux_shared = NULL;
+
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+/* slot of the backend */
+static dsm_segment   *mux_seg    = NULL;
+static shm_mq_handle *mux_req    = NULL;
+static shm_mq_handle *mux_resp   = NULL;
+static int            mux_nslot  = -1;
+static Latch         *mux_latch  = NULL;   /* latch of the worker serving the slot */
+
+PGDLLEXPORT void plexor_mux_main(Datum main_arg) pg_attribute_noreturn();
+
+
+static int
+plx_mux_max_clients(void)
+{
+    return MaxConnections + max_worker_processes;
+}
+
+static Size
+plx_mux_shmem_size(void)
+{
+    return add_size(offsetof(PlxMuxShared, clients),
+                    mul_size(sizeof(PlxMuxClient), plx_mux_max_clients()));
+}
+
+static void
+plx_mux_shmem_request(void)
+{
+#if PG_VERSION_NUM >= 150000
+    if (prev_shmem_request_hook)
+        prev_shmem_request_hook();
+#endif
+    RequestAddinShmemSpace(plx_mux_shmem_size());
+}
+
+static void
+plx_mux_shmem_startup(void)
+{
+    bool found;
+
+    if (prev_shmem_startup_hook)
+        prev_shmem_startup_hook();
+
+    LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+    plx_mux_shared = ShmemInitStruct("Plexor multiplexer", plx_mux_shmem_size(), &found);
+    if (!found)
+    {
+        MemSet(plx_mux_shared, 0, plx_mux_shmem_size());
+        SpinLockInit(&plx_mux_shared->mutex);
+        plx_mux_shared->nclients = plx_mux_max_clients();
+    }
+    LWLockRelease(AddinShmemInitLock);
+}
+
+/* Install shared memory hooks and register workers, called from _PG_init() */
+void
+plx_mux_init(void)
+{
+#ifdef LIBPQ_HAS_PIPELINING
+    BackgroundWorker worker;
+    int              i;
+#endif
+
+    if (!process_shared_preload_libraries_in_progress || plx_mux_workers == 0)
+        return;
+#ifndef LIBPQ_HAS_PIPELINING
+    elog(WARNING, "plexor: multiplexer needs libpq with pipelining, "
+                  "plexor.multiplexer_workers is ignored");
+    plx_mux_workers = 0;
+#else
+#if PG_VERSION_NUM >= 150000
+    prev_shmem_request_hook = shmem_request_hook;
+    shmem_request_hook = plx_mux_shmem_request;
+#else
+    plx_mux_shmem_request();
+#endif
+    prev_shmem_startup_hook = shmem_startup_hook;
+    shmem_startup_hook = plx_mux_shmem_startup;
+
+    MemSet(&worker, 0, sizeof(worker));
+    worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+    worker.bgw_start_time = BgWorkerStart_ConsistentState;
+    worker.bgw_restart_time = 1;
+    snprintf(worker.bgw_library_name, BGW_MAXLEN, "plexor");
+    snprintf(worker.bgw_function_name, BGW_MAXLEN, "plexor_mux_main");
+    snprintf(worker.bgw_type, BGW_MAXLEN, "plexor multiplexer");
+    for (i = 0; i < plx_mux_workers; i++)
+    {
+        snprintf(worker.bgw_name, BGW_MAXLEN, "plexor multiplexer %d", i);
+        worker.bgw_main_arg = Int32GetDatum(i);
+        RegisterBackgroundWorker(&worker);
+    }
+#endif
+}
+
+/* Strings are passed as is, without encoding conversion of pq_sendstring() */
+static void
+put_mux_string(StringInfo msg, const char *s)
+{
+    appendBinaryStringInfo(msg, s ? s : "", s ? strlen(s) + 1 : 1);
+}
+
+static void
+set_mux_msg(StringInfo msg, void *data, Size len)
+{
+    msg->data = data;
+    msg->len = len;
+    msg->maxlen = len;
+    msg->cursor = 0;
+}
+
+static shm_mq_result
+send_mux_msg(shm_mq_handle *mqh, StringInfo msg, bool nowait)
+{
+#if PG_VERSION_NUM >= 150000
+    return shm_mq_send(mqh, msg->len, msg->data, nowait, true);
+#else
+    return shm_mq_send(mqh, msg->len, msg->data, nowait);
+#endif
+}
+
+static void
+mux_detach_callback(dsm_segment *seg, Datum arg)
+{
+    PlxMuxClient *client = &plx_mux_shared->clients[DatumGetInt32(arg)];
+
+    SpinLockAcquire(&plx_mux_shared->mutex);
+    client->pid = 0;
+    client->handle = DSM_HANDLE_INVALID;
+    client->generation++;
+    SpinLockRelease(&plx_mux_shared->mutex);
+
+    mux_seg = NULL;
+    mux_req = NULL;
+    mux_resp = NULL;
+    mux_nslot = -1;
+    mux_latch = NULL;
+}
+
+/*
+ * Free slot served by a running worker or -1. A worker that didn't start
+ * or is restarting has no latch, its slots would never be served.
+ */
+static int
+find_mux_slot(void)
+{
+    int i;
+
+    for (i = 0; i < plx_mux_shared->nclients; i++)
+        if (!plx_mux_shared->clients[i].pid && plx_mux_shared->latches[i % plx_mux_workers])
+            return i;
+    return -1;
+}
+
+/*
+ * Take a slot for the backend. Returns false if the multiplexer is not
+ * running or all slots of running workers are taken.
+ */
+bool
+plx_mux_attach(void)
+{
+    MemoryContext old_ctx;
+    dsm_segment  *seg;
+    shm_mq       *mq;
+    char         *addr;
+    Latch        *latch;
+    int           i;
+
+    if (mux_seg)
+        return true;
+    if (!plx_mux_shared || plx_mux_workers == 0)
+        return false;
+
+    /* no queues are created while there is no slot to take */
+    SpinLockAcquire(&plx_mux_shared->mutex);
+    i = find_mux_slot();
+    SpinLockRelease(&plx_mux_shared->mutex);
+    if (i < 0)
+        return false;
+
+    old_ctx = MemoryContextSwitchTo(TopMemoryContext);
+    seg = dsm_create(PLX_MUX_QUEUE_SIZE * 2, 0);
+    dsm_pin_mapping(seg);
+    addr = dsm_segment_address(seg);
+    mq = shm_mq_create(addr, PLX_MUX_QUEUE_SIZE);
+    shm_mq_set_sender(mq, MyProc);
+    mq = shm_mq_create(addr + PLX_MUX_QUEUE_SIZE, PLX_MUX_QUEUE_SIZE);
+    shm_mq_set_receiver(mq, MyProc);
+    MemoryContextSwitchTo(old_ctx);
+
+    SpinLockAcquire(&plx_mux_shared->mutex);
+    if ((i = find_mux_slot()) >= 0)
+        plx_mux_shared->clients[i].pid = MyProcPid;
+    SpinLockRelease(&plx_mux_shared->mutex);
+    if (i < 0)
+    {
+        dsm_detach(seg);
+        return false;
+    }
+
+    old_ctx = MemoryContextSwitchTo(TopMemoryContext);
+    mux_seg = seg;
+    mux_req = shm_mq_attach((shm_mq *) addr, seg, NULL);
+    mux_resp = shm_mq_attach((shm_mq *) (addr + PLX_MUX_QUEUE_SIZE), seg, NULL);
+    on_dsm_detach(seg, mux_detach_callback, Int32GetDatum(i));
+    MemoryContextSwitchTo(old_ctx);
+
+    SpinLockAcquire(&plx_mux_shared->mutex);
+    plx_mux_shared->clients[i].handle = dsm_segment_handle(seg);
+    plx_mux_shared->clients[i].generation++;
+    latch = plx_mux_shared->latches[i % plx_mux_workers];
+    SpinLockRelease(&plx_mux_shared->mutex);
+    mux_nslot = i;
+    mux_latch = latch;
+    if (latch)
+        SetLatch(latch);
+    return true;
+}
+
+/* Worker serving the slot has not exited since the slot was taken */
+static bool
+is_mux_worker_alive(void)
+{
+    bool is_alive;
+
+    SpinLockAcquire(&plx_mux_shared->mutex);
+    is_alive = mux_latch && plx_mux_shared->latches[mux_nslot % plx_mux_workers] == mux_latch;
+    SpinLockRelease(&plx_mux_shared->mutex);
+    return is_alive;
+}
+
+/*
+ * Send the call and receive its result. Queues are polled without
+ * blocking, so a worker gone before it attached them is noticed by its
+ * latch cleared at exit instead of waiting forever.
+ */
+static shm_mq_result
+exchange_mux_msg(StringInfo msg, Size *len, void **data)
+{
+    shm_mq_result res;
+    bool          is_sent = false;
+
+    for (;;)
+    {
+        if (!is_sent)
+        {
+            res = send_mux_msg(mux_req, msg, true);
+            if (res == SHM_MQ_SUCCESS)
+            {
+                is_sent = true;
+                continue;
+            }
+        }
+        else
+            res = shm_mq_receive(mux_resp, len, data, true);
+        if (res != SHM_MQ_WOULD_BLOCK)
+            return res;
+        if (!is_mux_worker_alive())
+            return SHM_MQ_DETACHED;
+
+        (void) WaitLatch(MyLatch,
+                         WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+                         1000L,
+                         PG_WAIT_EXTENSION);
+        ResetLatch(MyLatch);
+        CHECK_FOR_INTERRUPTS();
+    }
+}
+
+static bool
+is_mux_connection_error(const char *sqlstate)
+{
+    return !*sqlstate || strncmp(sqlstate, "08", 2) == 0 || strncmp(sqlstate, "57P", 3) == 0;
+}
+
+static void
+mux_result_oom(PGresult *pg_result)
+{
+    PQclear(pg_result);
+    ereport(ERROR,
+            (errcode(ERRCODE_OUT_OF_MEMORY),
+             errmsg("out of memory")));
+}
+
+/* Build PGresult from the worker response or raise the remote error */
+static PGresult *
+read_mux_response(PlxCluster *plx_cluster, int nnode, void *data, Size len)
+{
+    StringInfoData  msg;
+    ExecStatusType  status;
+    PGresult       *pg_result;
+    PGresAttDesc   *attrs;
+    int             nfields;
+    int             ntuples;
+    int             i;
+    int             j;
+
+    set_mux_msg(&msg, data, len);
+    status = (ExecStatusType) pq_getmsgint(&msg, 4);
+    if (status != PGRES_TUPLES_OK && status != PGRES_COMMAND_OK)
+    {
+        const char *sqlstate = pq_getmsgrawstring(&msg);
+        const char *primary  = pq_getmsgrawstring(&msg);
+        const char *detail   = pq_getmsgrawstring(&msg);
+        const char *hint     = pq_getmsgrawstring(&msg);
+        const char *context  = pq_getmsgrawstring(&msg);
+
+        if (is_mux_connection_error(sqlstate))
+            plx_node_failure(plx_cluster, nnode);
+        else
+            plx_node_success(plx_cluster, nnode);
+        remote_error(*sqlstate ? sqlstate : NULL,
+                     primary,
+                     *detail ? detail : NULL,
+                     *hint ? hint : NULL,
+                     *context ? context : NULL);
+    }
+    plx_node_success(plx_cluster, nnode);
+
+    pg_result = PQmakeEmptyPGresult(NULL, status);
+    nfields = pq_getmsgint(&msg, 4);
+    attrs = palloc0(sizeof(PGresAttDesc) * (nfields + 1));
+    for (i = 0; i < nfields; i++)
+    {
+        attrs[i].name = (char *) pq_getmsgrawstring(&msg);
+        attrs[i].typid = pq_getmsgint(&msg, 4);
+        attrs[i].atttypmod = pq_getmsgint(&msg, 4);
+        attrs[i].format = pq_getmsgint(&msg, 4);
+        attrs[i].typlen = pq_getmsgint(&msg, 4);
+    }
+    if (!pg_result || !PQsetResultAttrs(pg_result, nfields, attrs))
+        mux_result_oom(pg_result);
+    pfree(attrs);
+
+    ntuples = pq_getmsgint(&msg, 4);
+    for (i = 0; i < ntuples; i++)
+        for (j = 0; j < nfields; j++)
+        {
+            int         value_len = pq_getmsgint(&msg, 4);
+            const char *value     = value_len < 0 ? NULL : pq_getmsgbytes(&msg, value_len);
+
+            if (!PQsetvalue(pg_result, i, j, (char *) value, value_len))
+                mux_result_oom(pg_result);
+        }
+    return pg_result;
+}
+
+/* Make a call through the multiplexer worker serving the slot of the backend */
+PGresult *
+plx_mux_call(PlxCluster *plx_cluster, int nnode, const char *dsn, const char *sql,
+             int nargs, char **args, int *arg_lens, int *arg_fmts, int result_fmt)
+{
+    StringInfoData          msg;
+    volatile shm_mq_result  res;
+    Size                    len;
+    void                   *data;
+    int                     i;
+
+    initStringInfo(&msg);
+    put_mux_string(&msg, dsn);
+    put_mux_string(&msg, sql);
+    pq_sendint32(&msg, result_fmt);
+    pq_sendint32(&msg, nargs);
+    for (i = 0; i < nargs; i++)
+    {
+        int arg_len = !args[i] ? -1 : arg_fmts[i] ? arg_lens[i] : strlen(args[i]);
+
+        pq_sendint32(&msg, arg_fmts[i]);
+        pq_sendint32(&msg, arg_len);
+        if (arg_len > 0)
+            pq_sendbytes(&msg, args[i], arg_len);
+    }
+
+    PG_TRY();
+    {
+        res = exchange_mux_msg(&msg, &len, &data);
+    }
+    PG_CATCH();
+    {
+        /* response to an interrupted call would be taken for the next one */
+        if (mux_seg)
+            dsm_detach(mux_seg);
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+    pfree(msg.data);
+
+    if (res != SHM_MQ_SUCCESS)
+    {
+        dsm_detach(mux_seg);
+        ereport(ERROR,
+                (errcode(ERRCODE_CONNECTION_FAILURE),
+                 errmsg("plexor multiplexer worker is gone")));
+    }
+    return read_mux_response(plx_cluster, nnode, data, len);
+}
+
+
+#ifdef LIBPQ_HAS_PIPELINING
+
+/* Call sent to a node by the worker */
+typedef struct MuxCall
+{
+    int              nclient;                /* slot the result goes to             */
+    uint64           generation;             /* generation of the slot              */
+    PGresult        *pg_result;              /* result or the first error           */
+    char            *request;                /* call waiting for the connect        */
+    Size             request_len;
+    struct MuxCall  *next;                   /* call sent after this one            */
+} MuxCall;
+
+/*
+ * Pipelined connection of the worker. It is opened by PQconnectPoll() in the
+ * event loop, so a slow node doesn't hold calls to the others.
+ */
+typedef struct MuxNode
+{
+    char            *dsn;                    /* connection string with user         */
+    PGconn          *pq_conn;                /* connection in pipeline mode         */
+    PostgresPollingStatusType poll;          /* PGRES_POLLING_OK once connected     */
+    TimestampTz      connect_deadline;       /* 0 without connect_timeout           */
+    bool             is_poll_ready;          /* socket is ready for PQconnectPoll() */
+    MuxCall         *pending_head;           /* calls waiting for the connect       */
+    MuxCall         *pending_tail;
+    MuxCall         *head;                   /* calls waiting for results, in order */
+    MuxCall         *tail;
+    bool             is_flush_pending;       /* output is not sent completely       */
+    pgsocket         sock;                   /* socket in the wait set              */
+    int              wait_pos;               /* position in the wait set            */
+    uint32           wait_events;            /* events the socket is waited for     */
+    struct MuxNode  *next;
+} MuxNode;
+
+/* Slot attached by the worker */
+typedef struct MuxClient
+{
+    dsm_segment     *seg;
+    shm_mq_handle   *req;                    /* calls from the backend              */
+    shm_mq_handle   *resp;                   /* results to the backend              */
+    uint64           generation;             /* generation the queues belong to     */
+} MuxClient;
+
+static int        mux_nworker;
+static MuxClient *mux_clients = NULL;
+static MuxNode   *mux_nodes   = NULL;
+static MemoryContext mux_call_mctx;
+
+/* sockets of the nodes, the set is rebuilt when the sockets change */
+static WaitEventSet *mux_wait_set = NULL;
+static bool          is_mux_wait_set_stale = true;
+
+
+static void
+drop_mux_client(int nclient)
+{
+    MuxClient *client = &mux_clients[nclient];
+
+    if (!client->seg)
+        return;
+    shm_mq_detach(client->req);
+    shm_mq_detach(client->resp);
+    dsm_detach(client->seg);
+    client->seg = NULL;
+    client->req = NULL;
+    client->resp = NULL;
+}
+
+/* Follow backends taking and releasing slots of the worker */
+static void
+refresh_mux_clients(void)
+{
+    int i;
+
+    for (i = mux_nworker; i < plx_mux_shared->nclients; i += plx_mux_workers)
+    {
+        MuxClient  *client = &mux_clients[i];
+        dsm_handle  handle;
+        uint64      generation;
+        char       *addr;
+
+        SpinLockAcquire(&plx_mux_shared->mutex);
+        handle = plx_mux_shared->clients[i].handle;
+        generation = plx_mux_shared->clients[i].generation;
+        SpinLockRelease(&plx_mux_shared->mutex);
+        if (generation == client->generation)
+            continue;
+
+        drop_mux_client(i);
+        client->generation = generation;
+        if (handle == DSM_HANDLE_INVALID || !(client->seg = dsm_attach(handle)))
+            continue;
+        addr = dsm_segment_address(client->seg);
+        shm_mq_set_receiver((shm_mq *) addr, MyProc);
+        shm_mq_set_sender((shm_mq *) (addr + PLX_MUX_QUEUE_SIZE), MyProc);
+        client->req = shm_mq_attach((shm_mq *) addr, client->seg, NULL);
+        client->resp = shm_mq_attach((shm_mq *) (addr + PLX_MUX_QUEUE_SIZE), client->seg, NULL);
+    }
+}
+
+static void
+reply_mux_call(MuxCall *call, StringInfo msg)
+{
+    MuxClient *client = &mux_clients[call->nclient];
+
+    /* backend has gone, or the slot was taken by another one */
+    if (client->generation != call->generation || !client->resp)
+        return;
+    if (send_mux_msg(client->resp, msg, false) != SHM_MQ_SUCCESS)
+        drop_mux_client(call->nclient);
+}
+
+static void
+reply_mux_error(MuxCall *call, const char *sqlstate, const char *message)
+{
+    StringInfoData msg;
+
+    initStringInfo(&msg);
+    pq_sendint32(&msg, PGRES_FATAL_ERROR);
+    put_mux_string(&msg, sqlstate);
+    put_mux_string(&msg, message);
+    put_mux_string(&msg, NULL);
+    put_mux_string(&msg, NULL);
+    put_mux_string(&msg, NULL);
+    reply_mux_call(call, &msg);
+}
+
+static void
+reply_mux_result(MuxCall *call)
+{
+    PGresult       *pg_result = call->pg_result;
+    ExecStatusType  status;
+    StringInfoData  msg;
+    int             i;
+    int             j;
+
+    if (!pg_result)
+    {
+        reply_mux_error(call, "08P01", "no result from node");
+        return;
+    }
+    status = PQresultStatus(pg_result);
+    if (status != PGRES_TUPLES_OK && status != PGRES_COMMAND_OK)
+    {
+        const char *primary = PQresultErrorField(pg_result, PG_DIAG_MESSAGE_PRIMARY);
+
+        initStringInfo(&msg);
+        pq_sendint32(&msg, status);
+        put_mux_string(&msg, PQresultErrorField(pg_result, PG_DIAG_SQLSTATE));
+        put_mux_string(&msg, primary ? primary : PQresultErrorMessage(pg_result));
+        put_mux_string(&msg, PQresultErrorField(pg_result, PG_DIAG_MESSAGE_DETAIL));
+        put_mux_string(&msg, PQresultErrorField(pg_result, PG_DIAG_MESSAGE_HINT));
+        put_mux_string(&msg, PQresultErrorField(pg_result, PG_DIAG_CONTEXT));
+        reply_mux_call(call, &msg);
+        return;
+    }
+
+    initStringInfo(&msg);
+    pq_sendint32(&msg, status);
+    pq_sendint32(&msg, PQnfields(pg_result));
+    for (i = 0; i < PQnfields(pg_result); i++)
+    {
+        put_mux_string(&msg, PQfname(pg_result, i));
+        pq_sendint32(&msg, PQftype(pg_result, i));
+        pq_sendint32(&msg, PQfmod(pg_result, i));
+        pq_sendint32(&msg, PQfformat(pg_result, i));
+        pq_sendint32(&msg, PQfsize(pg_result, i));
+    }
+    pq_sendint32(&msg, PQntuples(pg_result));
+    for (i = 0; i < PQntuples(pg_result); i++)
+        for (j = 0; j < PQnfields(pg_result); j++)
+        {
+            if (PQgetisnull(pg_result, i, j))
+                pq_sendint32(&msg, -1);
+            else
+            {
+                pq_sendint32(&msg, PQgetlength(pg_result, i, j));
+                pq_sendbytes(&msg, PQgetvalue(pg_result, i, j), PQgetlength(pg_result, i, j));
+            }
+        }
+    reply_mux_call(call, &msg);
+}
+
+static void
+fail_mux_calls(MuxCall *call, const char *sqlstate, const char *error)
+{
+    while (call)
+    {
+        MuxCall *next = call->next;
+
+        if (call->pg_result)
+            PQclear(call->pg_result);
+        reply_mux_error(call, sqlstate, error);
+        if (call->request)
+            pfree(call->request);
+        pfree(call);
+        call = next;
+    }
+}
+
+/*
+ * Connection is broken or failed to open: fail the calls sent over it or
+ * waiting for it and close it
+ */
+static void
+drop_mux_node(MuxNode *node)
+{
+    MuxNode **prev;
+    char     *error;
+
+    if (node->poll != PGRES_POLLING_OK && PQstatus(node->pq_conn) != CONNECTION_BAD)
+        error = pstrdup("timeout expired");
+    else
+        error = pstrdup(PQerrorMessage(node->pq_conn));
+    fail_mux_calls(node->head, "08006", error);
+    fail_mux_calls(node->pending_head, "08001", error);
+    for (prev = &mux_nodes; *prev != node; prev = &(*prev)->next)
+        ;
+    *prev = node->next;
+    PQfinish(node->pq_conn);
+    pfree(node->dsn);
+    pfree(node);
+    pfree(error);
+    is_mux_wait_set_stale = true;
+}
+
+/*
+ * Connection to the DSN, NULL with *error set if it can't be opened. A new
+ * connection is only started, calls wait for it in pending list.
+ */
+static MuxNode *
+get_mux_node(const char *dsn, char **error)
+{
+    MuxNode *node;
+    PGconn  *pq_conn;
+    int      timeout;
+
+    for (node = mux_nodes; node; node = node->next)
+        if (strcmp(node->dsn, dsn) == 0)
+            return node;
+
+    pq_conn = PQconnectStart(dsn);
+    if (!pq_conn || PQstatus(pq_conn) == CONNECTION_BAD)
+    {
+        *error = pstrdup(pq_conn ? PQerrorMessage(pq_conn) : "out of memory");
+        PQfinish(pq_conn);
+        return NULL;
+    }
+    node = MemoryContextAllocZero(TopMemoryContext, sizeof(MuxNode));
+    node->dsn = MemoryContextStrdup(TopMemoryContext, dsn);
+    node->pq_conn = pq_conn;
+    /* right after PQconnectStart() libpq behaves as if polling returned writing */
+    node->poll = PGRES_POLLING_WRITING;
+    if ((timeout = get_connect_timeout(pq_conn)) > 0)
+        node->connect_deadline = TimestampTzPlusMilliseconds(GetCurrentTimestamp(),
+                                                             timeout * 1000L);
+    node->next = mux_nodes;
+    mux_nodes = node;
+    is_mux_wait_set_stale = true;
+    return node;
+}
+
+/*
+ * Send the call to the connected node, each call is synced. Returns false
+ * if the connection broke and the node is dropped.
+ */
+static bool
+send_mux_query(MuxNode *node, MuxCall *call, void *data, Size len)
+{
+    StringInfoData  msg;
+    const char     *sql;
+    char          **values;
+    int            *lens;
+    int            *fmts;
+    int             result_fmt;
+    int             nargs;
+    int             i;
+
+    set_mux_msg(&msg, data, len);
+    (void) pq_getmsgrawstring(&msg);
+    sql = pq_getmsgrawstring(&msg);
+    result_fmt = pq_getmsgint(&msg, 4);
+    nargs = pq_getmsgint(&msg, 4);
+    values = palloc0(sizeof(char *) * (nargs + 1));
+    lens = palloc0(sizeof(int) * (nargs + 1));
+    fmts = palloc0(sizeof(int) * (nargs + 1));
+    for (i = 0; i < nargs; i++)
+    {
+        fmts[i] = pq_getmsgint(&msg, 4);
+        lens[i] = pq_getmsgint(&msg, 4);
+        if (lens[i] >= 0)
+        {
+            /* text values must be zero terminated */
+            values[i] = palloc(lens[i] + 1);
+            pq_copymsgbytes(&msg, values[i], lens[i]);
+            values[i][lens[i]] = '\0';
+        }
+    }
+
+    if (node->tail)
+        node->tail->next = call;
+    else
+        node->head = call;
+    node->tail = call;
+    if (!PQsendQueryParams(node->pq_conn, sql, nargs, NULL,
+                           (const char * const *) values, lens, fmts, result_fmt) ||
+        !PQpipelineSync(node->pq_conn))
+    {
+        drop_mux_node(node);
+        return false;
+    }
+    return true;
+}
+
+/* Send call received from the backend, or keep it until the node connects */
+static void
+send_mux_call(int nclient, void *data, Size len)
+{
+    StringInfoData  msg;
+    MuxCall        *call;
+    MuxNode        *node;
+    char           *error;
+
+    call = MemoryContextAllocZero(TopMemoryContext, sizeof(MuxCall));
+    call->nclient = nclient;
+    call->generation = mux_clients[nclient].generation;
+
+    set_mux_msg(&msg, data, len);
+    if (!(node = get_mux_node(pq_getmsgrawstring(&msg), &error)))
+    {
+        reply_mux_error(call, "08001", error);
+        pfree(call);
+        return;
+    }
+    if (node->poll == PGRES_POLLING_OK)
+    {
+        (void) send_mux_query(node, call, data, len);
+        return;
+    }
+    call->request = MemoryContextAlloc(TopMemoryContext, len);
+    memcpy(call->request, data, len);
+    call->request_len = len;
+    if (node->pending_tail)
+        node->pending_tail->next = call;
+    else
+        node->pending_head = call;
+    node->pending_tail = call;
+}
+
+static void
+receive_mux_calls(void)
+{
+    int i;
+
+    for (i = mux_nworker; i < plx_mux_shared->nclients; i += plx_mux_workers)
+    {
+        MuxClient     *client = &mux_clients[i];
+        shm_mq_result  res;
+        Size           len;
+        void          *data;
+
+        if (!client->req)
+            continue;
+        res = shm_mq_receive(client->req, &len, &data, true);
+        if (res == SHM_MQ_SUCCESS)
+            send_mux_call(i, data, len);
+        else if (res == SHM_MQ_DETACHED)
+            drop_mux_client(i);
+    }
+}
+
+/* Pass results which have arrived to the backends */
+static void
+read_mux_node(MuxNode *node)
+{
+    int flush;
+
+    if ((flush = PQflush(node->pq_conn)) < 0 || !PQconsumeInput(node->pq_conn))
+    {
+        drop_mux_node(node);
+        return;
+    }
+    node->is_flush_pending = flush > 0;
+
+    while (node->head && !PQisBusy(node->pq_conn))
+    {
+        MuxCall        *call = node->head;
+        PGresult       *pg_result;
+        ExecStatusType  status;
+
+        /* NULL ends results of a query in the pipeline */
+        if (!(pg_result = PQgetResult(node->pq_conn)))
+            continue;
+        status = PQresultStatus(pg_result);
+        if (status == PGRES_PIPELINE_SYNC)
+        {
+            PQclear(pg_result);
+            node->head = call->next;
+            if (!node->head)
+                node->tail = NULL;
+            reply_mux_result(call);
+            if (call->pg_result)
+                PQclear(call->pg_result);
+            pfree(call);
+        }
+        else if (!call->pg_result ||
+                 (status != PGRES_TUPLES_OK && status != PGRES_COMMAND_OK &&
+                  (PQresultStatus(call->pg_result) == PGRES_TUPLES_OK ||
+                   PQresultStatus(call->pg_result) == PGRES_COMMAND_OK)))
+        {
+            if (call->pg_result)
+                PQclear(call->pg_result);
+            call->pg_result = pg_result;
+        }
+        else
+            PQclear(pg_result);
+    }
+    if (PQstatus(node->pq_conn) == CONNECTION_BAD)
+        drop_mux_node(node);
+}
+
+/*
+ * Continue the connect when the socket is ready, once the node is connected
+ * send the calls waiting for it. The connect fails after connect_timeout.
+ */
+static void
+poll_mux_node(MuxNode *node)
+{
+    if (node->is_poll_ready)
+    {
+        node->is_poll_ready = false;
+        node->poll = PQconnectPoll(node->pq_conn);
+        /* libpq opens a new socket for the next address of the host */
+        if (PQsocket(node->pq_conn) != node->sock)
+            is_mux_wait_set_stale = true;
+    }
+    if (node->poll == PGRES_POLLING_FAILED ||
+        (node->poll != PGRES_POLLING_OK && node->connect_deadline > 0 &&
+         GetCurrentTimestamp() >= node->connect_deadline))
+    {
+        drop_mux_node(node);
+        return;
+    }
+    if (node->poll != PGRES_POLLING_OK)
+        return;
+
+    if (PQsetnonblocking(node->pq_conn, 1) || !PQenterPipelineMode(node->pq_conn))
+    {
+        drop_mux_node(node);
+        return;
+    }
+    while (node->pending_head)
+    {
+        MuxCall *call    = node->pending_head;
+        char    *request = call->request;
+
+        node->pending_head = call->next;
+        if (!node->pending_head)
+            node->pending_tail = NULL;
+        call->next = NULL;
+        call->request = NULL;
+        if (!send_mux_query(node, call, request, call->request_len))
+        {
+            pfree(request);
+            return;
+        }
+        pfree(request);
+    }
+    read_mux_node(node);
+}
+
+static uint32
+get_mux_node_events(MuxNode *node)
+{
+    if (node->poll == PGRES_POLLING_READING)
+        return WL_SOCKET_READABLE;
+    if (node->poll == PGRES_POLLING_WRITING)
+        return WL_SOCKET_WRITEABLE;
+    return WL_SOCKET_READABLE | (node->is_flush_pending ? WL_SOCKET_WRITEABLE : 0);
+}
+
+/*
+ * Sleep until a backend sends a call, a node sends results or a connect
+ * can go on. The wait set is kept between calls and rebuilt only when
+ * nodes are added, dropped or change their sockets.
+ */
+static void
+wait_mux_events(void)
+{
+    WaitEvent    *events;
+    MuxNode      *node;
+    TimestampTz   now     = GetCurrentTimestamp();
+    long          timeout = 1000L;
+    int           nnodes  = 0;
+    int           nevents;
+    int           i;
+
+    for (node = mux_nodes; node; node = node->next)
+    {
+        nnodes++;
+        if (node->poll != PGRES_POLLING_OK && node->connect_deadline > 0)
+            timeout = Min(timeout,
+                          Max(TimestampDifferenceMilliseconds(now, node->connect_deadline), 0));
+    }
+
+    if (is_mux_wait_set_stale)
+    {
+        if (mux_wait_set)
+            FreeWaitEventSet(mux_wait_set);
+        mux_wait_set = create_wait_set(nnodes, true);
+        for (node = mux_nodes; node; node = node->next)
+        {
+            node->sock = PQsocket(node->pq_conn);
+            node->wait_events = get_mux_node_events(node);
+            node->wait_pos = AddWaitEventToSet(mux_wait_set, node->wait_events,
+                                               node->sock, NULL, node);
+        }
+        is_mux_wait_set_stale = false;
+    }
+    else
+        for (node = mux_nodes; node; node = node->next)
+        {
+            uint32 wait_events = get_mux_node_events(node);
+
+            if (wait_events != node->wait_events)
+            {
+                ModifyWaitEvent(mux_wait_set, node->wait_pos, wait_events, NULL);
+                node->wait_events = wait_events;
+            }
+        }
+
+    events = palloc(sizeof(WaitEvent) * (nnodes + 2));
+    nevents = WaitEventSetWait(mux_wait_set, timeout, events, nnodes + 2, PG_WAIT_EXTENSION);
+    for (i = 0; i < nevents; i++)
+        if (events[i].events & WL_SOCKET_MASK)
+            ((MuxNode *) events[i].user_data)->is_poll_ready = true;
+    pfree(events);
+}
+
+static void
+mux_worker_exit(int code, Datum arg)
+{
+    SpinLockAcquire(&plx_mux_shared->mutex);
+    plx_mux_shared->latches[mux_nworker] = NULL;
+    SpinLockRelease(&plx_mux_shared->mutex);
+}
+
+void
+plexor_mux_main(Datum main_arg)
+{
+    mux_nworker = DatumGetInt32(main_arg);
+    pqsignal(SIGTERM, die);
+    BackgroundWorkerUnblockSignals();
+
+    mux_clients = MemoryContextAllocZero(TopMemoryContext,
+                                         sizeof(MuxClient) * plx_mux_shared->nclients);
+    mux_call_mctx = AllocSetContextCreate(TopMemoryContext,
+                                          "plexor multiplexer calls",
+                                          ALLOCSET_DEFAULT_SIZES);
+    SpinLockAcquire(&plx_mux_shared->mutex);
+    plx_mux_shared->latches[mux_nworker] = MyLatch;
+    SpinLockRelease(&plx_mux_shared->mutex);
+    on_shmem_exit(mux_worker_exit, (Datum) 0);
+
+    for (;;)
+    {
+        MuxNode *node;
+        MuxNode *next;
+
+        ResetLatch(MyLatch);
+        CHECK_FOR_INTERRUPTS();
+
+        /* queues and connections are kept in TopMemoryContext */
+        MemoryContextReset(mux_call_mctx);
+        refresh_mux_clients();
+        MemoryContextSwitchTo(mux_call_mctx);
+        receive_mux_calls();
+        for (node = mux_nodes; node; node = next)
+        {
+            next = node->next;
+            if (node->poll == PGRES_POLLING_OK)
+                read_mux_node(node);
+            else
+                poll_mux_node(node);
+        }
+        MemoryContextSwitchTo(TopMemoryContext);
+        wait_mux_events();
+    }
+}
+
+#else
+
+void
+plexor_mux_main(Datum main_arg)
+{
+    proc_exit(0);
+}
+
+#endif
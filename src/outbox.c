@@ -0,0 +1,508 @@
+/*
+ * Copyright (c) 2015, Dima Beloborodov, Andrey Chernyakov, (CoMagic, UIS)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *    This product includes software developed by the <organization>.
+ * 4. Neither the name of the <organization> nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "plexor.h"
+
+
+/*
+ * Outbox of remote calls. plexor_enqueue() stores a call of a plexor
+ * function in plexor.outbox table inside the caller's transaction, the
+ * background worker delivers the stored calls later. The row is inserted
+ * as the owner of the table along with the role of the caller, and the
+ * call is made as that role, so roles need no rights on the table and
+ * can't make calls on behalf of others. The calls of a batch
+ * are made in one local transaction, so every node gets one remote
+ * transaction that is committed along with the removal of the delivered
+ * rows. A failed call is retried with exponential backoff.
+ *
+ * A call may be delivered more than once if the local commit fails after
+ * the remote one, so the worker passes the idempotency key of the call to
+ * the node in plexor.idempotency_key setting.
+ */
+
+#define OUTBOX_MAX_BACKOFF 3600              /* seconds between retries at most */
+
+/* exponent is capped, so 2 ^ attempts doesn't overflow float8 */
+#define OUTBOX_POSTPONE_SET \
+    "   set attempts = attempts + 1," \
+    "       next_attempt_at = now() + least(2 ^ least(attempts, 12), " \
+    CppAsString2(OUTBOX_MAX_BACKOFF) ") * interval '1 second'," \
+    "       last_error = $2"
+
+static volatile sig_atomic_t got_sighup = false;
+
+/* calls of the batch the worker delivers, postponed if the batch fails */
+static int64 *outbox_batch_ids  = NULL;
+static int    outbox_batch_nids = 0;
+static int    outbox_batch_size = 0;
+
+PG_FUNCTION_INFO_V1(plexor_enqueue);
+PG_FUNCTION_INFO_V1(plexor_outbox_drain);
+
+PGDLLEXPORT void plexor_outbox_main(Datum main_arg) pg_attribute_noreturn();
+
+
+/* Owner of plexor.outbox table, the calls are enqueued as it */
+static Oid
+get_outbox_owner(void)
+{
+    Oid       relid = get_relname_relid("outbox", get_namespace_oid("plexor", false));
+    HeapTuple rel_tuple;
+    Oid       owner;
+
+    rel_tuple = SearchSysCache1(RELOID, ObjectIdGetDatum(relid));
+    if (!HeapTupleIsValid(rel_tuple))
+        elog(ERROR, "plexor: table plexor.outbox doesn't exist");
+    owner = ((Form_pg_class) GETSTRUCT(rel_tuple))->relowner;
+    ReleaseSysCache(rel_tuple);
+    return owner;
+}
+
+Datum
+plexor_enqueue(PG_FUNCTION_ARGS)
+{
+    Oid           fn_oid = PG_GETARG_OID(0);
+    ArrayType    *args   = PG_GETARG_ARRAYTYPE_P(1);
+    Oid           userid = GetUserId();
+    Oid           argtypes[3] = { REGPROCEDUREOID, TEXTARRAYOID, REGROLEOID };
+    Datum         values[3];
+    HeapTuple     proc_tuple;
+    Form_pg_proc  proc_struct;
+    AclResult     acl_result;
+    Oid           save_userid;
+    int           save_sec_context;
+    int           nargs;
+    bool          isnull;
+    int64         id;
+
+#if PG_VERSION_NUM >= 160000
+    acl_result = object_aclcheck(ProcedureRelationId, fn_oid, userid, ACL_EXECUTE);
+#else
+    acl_result = pg_proc_aclcheck(fn_oid, userid, ACL_EXECUTE);
+#endif
+    if (acl_result != ACLCHECK_OK)
+        aclcheck_error(acl_result, OBJECT_FUNCTION, get_func_name(fn_oid));
+
+    proc_tuple = SearchSysCache1(PROCOID, ObjectIdGetDatum(fn_oid));
+    if (!HeapTupleIsValid(proc_tuple))
+        elog(ERROR, "cache lookup failed for function %u", fn_oid);
+    proc_struct = (Form_pg_proc) GETSTRUCT(proc_tuple);
+    if (proc_struct->prolang != get_language_oid("plexor", false))
+        ereport(ERROR,
+                (errcode(ERRCODE_WRONG_OBJECT_TYPE),
+                 errmsg("function %s is not a plexor function",
+                        format_procedure(fn_oid))));
+    nargs = ARR_NDIM(args) ? ArrayGetNItems(ARR_NDIM(args), ARR_DIMS(args)) : 0;
+    if (ARR_NDIM(args) > 1 || nargs != proc_struct->pronargs)
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("function %s takes %d arguments",
+                        format_procedure(fn_oid), proc_struct->pronargs)));
+    ReleaseSysCache(proc_tuple);
+
+    values[0] = ObjectIdGetDatum(fn_oid);
+    values[1] = PointerGetDatum(args);
+    values[2] = ObjectIdGetDatum(userid);
+    if (SPI_connect() != SPI_OK_CONNECT)
+        elog(ERROR, "plexor: SPI_connect failed");
+    /* error restores the user at transaction abort */
+    GetUserIdAndSecContext(&save_userid, &save_sec_context);
+    SetUserIdAndSecContext(get_outbox_owner(),
+                           save_sec_context | SECURITY_LOCAL_USERID_CHANGE);
+    if (SPI_execute_with_args("insert into plexor.outbox (fn, args, role)"
+                              " values ($1, $2, $3) returning id",
+                              3, argtypes, values, NULL, false, 1) != SPI_OK_INSERT_RETURNING)
+        elog(ERROR, "plexor: failed to enqueue call of function %u", fn_oid);
+    SetUserIdAndSecContext(save_userid, save_sec_context);
+    id = DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1, &isnull));
+    SPI_finish();
+    PG_RETURN_INT64(id);
+}
+
+/* "select schema.fn($1::type, ...)" to call the function with text arguments */
+static char *
+get_outbox_call_sql(Oid fn_oid, int nargs)
+{
+    HeapTuple     proc_tuple;
+    Form_pg_proc  proc_struct;
+    StringInfoData sql;
+    int           i;
+
+    proc_tuple = SearchSysCache1(PROCOID, ObjectIdGetDatum(fn_oid));
+    if (!HeapTupleIsValid(proc_tuple))
+        elog(ERROR, "function %u of outbox call doesn't exist", fn_oid);
+    proc_struct = (Form_pg_proc) GETSTRUCT(proc_tuple);
+    if (nargs != proc_struct->pronargs)
+        elog(ERROR, "outbox call has %d arguments, function %s takes %d",
+             nargs, format_procedure(fn_oid), proc_struct->pronargs);
+
+    initStringInfo(&sql);
+    appendStringInfo(&sql, "select %s(",
+                     quote_qualified_identifier(get_namespace_name(proc_struct->pronamespace),
+                                                NameStr(proc_struct->proname)));
+    for (i = 0; i < nargs; i++)
+        appendStringInfo(&sql, "%s$%d::%s",
+                         i ? ", " : "",
+                         i + 1,
+                         format_type_be_qualified(proc_struct->proargtypes.values[i]));
+    appendStringInfoChar(&sql, ')');
+    ReleaseSysCache(proc_tuple);
+    return sql.data;
+}
+
+/*
+ * Connection error loses the remote transaction of the node along with the
+ * calls of the batch already made over it, so it fails the whole batch.
+ */
+static bool
+is_outbox_batch_error(ErrorData *edata, uint64 lost_remote_xacts)
+{
+    const char *sqlstate = unpack_sql_state(edata->sqlerrcode);
+
+    return plx_lost_remote_xacts != lost_remote_xacts ||
+           strncmp(sqlstate, "08", 2) == 0 ||
+           strncmp(sqlstate, "57P", 3) == 0;
+}
+
+/*
+ * Make a single outbox call as the role that enqueued it in subtransaction,
+ * so a failed call doesn't break the others of the batch. Delivered call is
+ * removed from the outbox, failed one is postponed. Connection errors are
+ * raised to fail the batch.
+ */
+static void
+deliver_outbox_call(int64 id, Oid fn_oid, Oid role, ArrayType *args)
+{
+    Oid           save_userid;
+    int           save_sec_context;
+    MemoryContext old_ctx   = CurrentMemoryContext;
+    ResourceOwner old_owner = CurrentResourceOwner;
+    uint64        lost_remote_xacts = plx_lost_remote_xacts;
+    Oid           argtypes[2] = { INT8OID, TEXTOID };
+    Datum         values[2];
+    Datum        *elems;
+    bool         *elem_nulls;
+    int           nelems;
+    Oid          *elem_types;
+    char         *nulls;
+    char         *error = NULL;
+    int           i;
+
+    deconstruct_array(args, TEXTOID, -1, false, 'i', &elems, &elem_nulls, &nelems);
+    elem_types = palloc(sizeof(Oid) * (nelems + 1));
+    nulls = palloc(nelems + 1);
+    for (i = 0; i < nelems; i++)
+    {
+        elem_types[i] = TEXTOID;
+        nulls[i] = elem_nulls[i] ? 'n' : ' ';
+    }
+
+    SetConfigOption("plexor.idempotency_key",
+                    psprintf(UINT64_FORMAT ":" INT64_FORMAT, GetSystemIdentifier(), id),
+                    PGC_USERSET, PGC_S_SESSION);
+    GetUserIdAndSecContext(&save_userid, &save_sec_context);
+    BeginInternalSubTransaction(NULL);
+    MemoryContextSwitchTo(old_ctx);
+
+    /* subtransaction abort gives back the user of the worker */
+    PG_TRY();
+    {
+        char *sql = get_outbox_call_sql(fn_oid, nelems);
+
+        if (!SearchSysCacheExists1(AUTHOID, ObjectIdGetDatum(role)))
+            elog(ERROR, "role %u of outbox call doesn't exist", role);
+        SetUserIdAndSecContext(role, save_sec_context | SECURITY_LOCAL_USERID_CHANGE);
+        if (SPI_execute_with_args(sql, nelems, elem_types, elems, nulls, false, 1) < 0)
+            elog(ERROR, "plexor: outbox call '%s' failed", sql);
+        SetUserIdAndSecContext(save_userid, save_sec_context);
+        ReleaseCurrentSubTransaction();
+        MemoryContextSwitchTo(old_ctx);
+        CurrentResourceOwner = old_owner;
+    }
+    PG_CATCH();
+    {
+        ErrorData *edata;
+
+        MemoryContextSwitchTo(old_ctx);
+        edata = CopyErrorData();
+        if (is_outbox_batch_error(edata, lost_remote_xacts))
+        {
+            SetConfigOption("plexor.idempotency_key", "", PGC_USERSET, PGC_S_SESSION);
+            PG_RE_THROW();
+        }
+        FlushErrorState();
+        RollbackAndReleaseCurrentSubTransaction();
+        MemoryContextSwitchTo(old_ctx);
+        CurrentResourceOwner = old_owner;
+
+        error = edata->message;
+        elog(LOG, "plexor: outbox call " INT64_FORMAT " of function %u failed: %s",
+             id, fn_oid, error);
+    }
+    PG_END_TRY();
+    SetConfigOption("plexor.idempotency_key", "", PGC_USERSET, PGC_S_SESSION);
+
+    values[0] = Int64GetDatum(id);
+    if (!error)
+    {
+        if (SPI_execute_with_args("delete from plexor.outbox where id = $1",
+                                  1, argtypes, values, NULL, false, 0) != SPI_OK_DELETE)
+            elog(ERROR, "plexor: failed to delete outbox call " INT64_FORMAT, id);
+        return;
+    }
+    values[1] = CStringGetTextDatum(error);
+    if (SPI_execute_with_args("update plexor.outbox"
+                              OUTBOX_POSTPONE_SET
+                              " where id = $1",
+                              2, argtypes, values, NULL, false, 0) != SPI_OK_UPDATE)
+        elog(ERROR, "plexor: failed to postpone outbox call " INT64_FORMAT, id);
+}
+
+/*
+ * Deliver calls which are due, returns the number of calls made. The worker
+ * keeps ids of the calls in outbox_batch_ids.
+ */
+static int
+deliver_outbox_batch(bool is_worker)
+{
+    Oid             argtypes[1] = { INT4OID };
+    Datum           values[1];
+    SPITupleTable  *batch;
+    int             ncalls;
+    int             i;
+
+    values[0] = Int32GetDatum(plx_outbox_batch_size);
+    if (SPI_connect() != SPI_OK_CONNECT)
+        elog(ERROR, "plexor: SPI_connect failed");
+    if (SPI_execute_with_args("select id, fn, args, role"
+                              "  from plexor.outbox"
+                              " where next_attempt_at <= now()"
+                              " order by id"
+                              " limit $1"
+                              "   for update skip locked",
+                              1, argtypes, values, NULL, false, 0) != SPI_OK_SELECT)
+        elog(ERROR, "plexor: failed to read outbox");
+
+    batch = SPI_tuptable;
+    ncalls = SPI_processed;
+    if (is_worker)
+        outbox_batch_nids = ncalls;
+    for (i = 0; i < ncalls; i++)
+    {
+        HeapTuple tuple = batch->vals[i];
+        bool      isnull;
+        int64     id;
+        Oid       fn_oid;
+        Oid       role;
+        Datum     args;
+
+        id = DatumGetInt64(SPI_getbinval(tuple, batch->tupdesc, 1, &isnull));
+        if (is_worker)
+            outbox_batch_ids[i] = id;
+        fn_oid = DatumGetObjectId(SPI_getbinval(tuple, batch->tupdesc, 2, &isnull));
+        args = SPI_getbinval(tuple, batch->tupdesc, 3, &isnull);
+        role = DatumGetObjectId(SPI_getbinval(tuple, batch->tupdesc, 4, &isnull));
+        deliver_outbox_call(id, fn_oid, role, DatumGetArrayTypeP(args));
+    }
+    SPI_finish();
+    return ncalls;
+}
+
+/*
+ * Deliver calls which are due in the current transaction, a test hook that
+ * does what one pass of the worker does. It makes calls as other roles, so
+ * it is for superusers only.
+ */
+Datum
+plexor_outbox_drain(PG_FUNCTION_ARGS)
+{
+    if (!superuser())
+        ereport(ERROR,
+                (errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+                 errmsg("must be superuser to drain the outbox")));
+    PG_RETURN_INT32(deliver_outbox_batch(false));
+}
+
+/* Postpone calls of the failed batch in a transaction of its own */
+static void
+postpone_outbox_batch(int64 *ids, int nids, const char *error)
+{
+    MemoryContext old_ctx     = CurrentMemoryContext;
+    Oid           argtypes[2] = { INT8ARRAYOID, TEXTOID };
+    Datum         values[2];
+    Datum        *elems;
+    int           i;
+
+    SetCurrentStatementStartTimestamp();
+    StartTransactionCommand();
+    PushActiveSnapshot(GetTransactionSnapshot());
+    PG_TRY();
+    {
+        elems = palloc(sizeof(Datum) * nids);
+        for (i = 0; i < nids; i++)
+            elems[i] = Int64GetDatum(ids[i]);
+        values[0] = PointerGetDatum(construct_array(elems, nids, INT8OID, 8,
+                                                    FLOAT8PASSBYVAL, 'd'));
+        values[1] = CStringGetTextDatum(error);
+        if (SPI_connect() != SPI_OK_CONNECT)
+            elog(ERROR, "plexor: SPI_connect failed");
+        if (SPI_execute_with_args("update plexor.outbox"
+                                  OUTBOX_POSTPONE_SET
+                                  " where id = any($1)",
+                                  2, argtypes, values, NULL, false, 0) != SPI_OK_UPDATE)
+            elog(ERROR, "plexor: failed to postpone outbox batch");
+        SPI_finish();
+        PopActiveSnapshot();
+        CommitTransactionCommand();
+    }
+    PG_CATCH();
+    {
+        MemoryContextSwitchTo(old_ctx);
+        EmitErrorReport();
+        FlushErrorState();
+        AbortCurrentTransaction();
+    }
+    PG_END_TRY();
+    MemoryContextSwitchTo(old_ctx);
+}
+
+/*
+ * Deliver a batch in its own transaction. If the transaction fails, a
+ * failed remote commit or a lost connection for example, the error is
+ * logged and all the calls of the batch are postponed.
+ */
+static int
+drain_outbox(void)
+{
+    MemoryContext         old_ctx = CurrentMemoryContext;
+    volatile int          ncalls  = 0;
+    ErrorData *volatile   edata   = NULL;
+
+    if (outbox_batch_size != plx_outbox_batch_size)
+    {
+        if (outbox_batch_ids)
+            pfree(outbox_batch_ids);
+        outbox_batch_size = plx_outbox_batch_size;
+        outbox_batch_ids = MemoryContextAlloc(TopMemoryContext,
+                                              sizeof(int64) * outbox_batch_size);
+    }
+    outbox_batch_nids = 0;
+
+    SetCurrentStatementStartTimestamp();
+    StartTransactionCommand();
+    PushActiveSnapshot(GetTransactionSnapshot());
+    pgstat_report_activity(STATE_RUNNING, "plexor outbox delivery");
+
+    PG_TRY();
+    {
+        ncalls = deliver_outbox_batch(true);
+        PopActiveSnapshot();
+        CommitTransactionCommand();
+    }
+    PG_CATCH();
+    {
+        MemoryContextSwitchTo(old_ctx);
+        edata = CopyErrorData();
+        EmitErrorReport();
+        FlushErrorState();
+        AbortCurrentTransaction();
+    }
+    PG_END_TRY();
+
+    MemoryContextSwitchTo(old_ctx);
+    if (edata)
+    {
+        if (outbox_batch_nids > 0)
+            postpone_outbox_batch(outbox_batch_ids, outbox_batch_nids, edata->message);
+        FreeErrorData(edata);
+        ncalls = 0;
+    }
+    pgstat_report_activity(STATE_IDLE, NULL);
+    return ncalls;
+}
+
+static void
+outbox_sighup(SIGNAL_ARGS)
+{
+    int save_errno = errno;
+
+    got_sighup = true;
+    SetLatch(MyLatch);
+    errno = save_errno;
+}
+
+void
+plexor_outbox_main(Datum main_arg)
+{
+    pqsignal(SIGHUP, outbox_sighup);
+    pqsignal(SIGTERM, die);
+    BackgroundWorkerUnblockSignals();
+    BackgroundWorkerInitializeConnection(plx_outbox_database, NULL, 0);
+
+    for (;;)
+    {
+        CHECK_FOR_INTERRUPTS();
+        if (got_sighup)
+        {
+            got_sighup = false;
+            ProcessConfigFile(PGC_SIGHUP);
+        }
+        /* full batch means more calls are probably due */
+        if (drain_outbox() < plx_outbox_batch_size)
+        {
+            (void) WaitLatch(MyLatch,
+                             WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+                             plx_outbox_naptime,
+                             PG_WAIT_EXTENSION);
+            ResetLatch(MyLatch);
+        }
+    }
+}
+
+/* Register the outbox worker, called from _PG_init() */
+void
+plx_outbox_init(void)
+{
+    BackgroundWorker worker;
+
+    if (!process_shared_preload_libraries_in_progress ||
+        !plx_outbox_database || !*plx_outbox_database)
+        return;
+
+    MemSet(&worker, 0, sizeof(worker));
+    worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+    worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+    worker.bgw_restart_time = 10;
+    snprintf(worker.bgw_library_name, BGW_MAXLEN, "plexor");
+    snprintf(worker.bgw_function_name, BGW_MAXLEN, "plexor_outbox_main");
+    snprintf(worker.bgw_name, BGW_MAXLEN, "plexor outbox");
+    snprintf(worker.bgw_type, BGW_MAXLEN, "plexor outbox");
+    RegisterBackgroundWorker(&worker);
+}
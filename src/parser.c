@@ -49,6 +49,10 @@ typedef enum TokenType
     NUMBER        = 12,
     SEMICOLON     = 13,
     COALESCE      = 14,
+    IDEMPOTENT    = 15,
+    READ          = 16,
+    READ_ONLY     = 17,
+    DEFERRED      = 18,
 } TokenType;
 
 
@@ -137,6 +141,23 @@ get_token_start_len(PlxFn *plx_fn, const char *text, int text_len, int *pos, int
     }
 }
 
+/* Join two word keyword, token is appended to prev and freed */
+static Token *
+merge_tokens(Token *prev, Token *token, TokenType type)
+{
+    int prev_len = strlen(prev->value);
+    int len      = strlen(token->value);
+
+    prev->type = type;
+    prev->value = repalloc(prev->value, prev_len + len + 2);
+    prev->value[prev_len] = ' ';
+    memcpy(prev->value + prev_len + 1, token->value, len + 1);
+
+    pfree(token->value);
+    pfree(token);
+    return prev;
+}
+
 static Token *
 get_token(PlxFn *plx_fn, const char *text, int text_len, int *pos, Token *prev)
 {
@@ -166,24 +187,18 @@ get_token(PlxFn *plx_fn, const char *text, int text_len, int *pos, Token *prev)
         else if (!strcmp(token->value, "coalesce"))
         {
             if (prev && prev->type == ALL)
-            {
-                int prev_len = strlen(prev->value);
-
-                prev->type = ALL_COALESCE;
-                prev->value = repalloc(prev->value, len + 2);
-
-                prev->value[prev_len] = ' ';
-                memcpy(prev->value + prev_len + 1, text + start, len);
-                prev->value[prev_len + len + 2] = 0;
-
-                pfree(token->value);
-                pfree(token);
-
-                return prev;
-            }
+                return merge_tokens(prev, token, ALL_COALESCE);
             else
                 token->type = IDENT;
         }
+        else if (!strcmp(token->value, "idempotent") && prev && prev->type == SEMICOLON)
+            token->type = IDEMPOTENT;
+        else if (!strcmp(token->value, "deferred") && prev && prev->type == SEMICOLON)
+            token->type = DEFERRED;
+        else if (!strcmp(token->value, "read") && prev && prev->type == SEMICOLON)
+            token->type = READ;
+        else if (!strcmp(token->value, "only") && prev && prev->type == READ)
+            return merge_tokens(prev, token, READ_ONLY);
         else if (!strcmp(token->value, ";"))
             token->type = SEMICOLON;
         else if (!strcmp(token->value, ","))
@@ -191,7 +206,7 @@ get_token(PlxFn *plx_fn, const char *text, int text_len, int *pos, Token *prev)
         else if (!strcmp(token->value, "("))
         {
             token->type = O_PARENTHESIS;
-            if (prev->type == IDENT)
+            if (prev && prev->type == IDENT)
                 prev->type = FUNCTION;
 
         }
@@ -287,6 +302,9 @@ typedef struct PlxStmt
 {
     PlxClusterStmt *cluster_stmt;
     PlxRunStmt     *run_stmt;
+    int             is_idempotent;
+    int             is_read_only;
+    int             is_deferred;
 } PlxStmt;
 
 
@@ -446,6 +464,38 @@ get_run_stmt(PlxFn *plx_fn, Lexer *lexer)
     return run_stmt;
 }
 
+/*
+ * Option statements are keywords closed by ';' that follow any other
+ * statement, e.g. "idempotent;", "read only;" or "deferred;".
+ */
+static void
+get_option_stmts(PlxFn *plx_fn, Lexer *lexer, PlxStmt *plx_stmt)
+{
+    int i;
+
+    for (i = 0; i < lexer->count; i++)
+    {
+        Token *token = lexer->tokens[i];
+
+        if (token->type == READ)
+            plx_syntax_error(plx_fn, "'only' expected after 'read'");
+        if (token->type != IDEMPOTENT &&
+            token->type != READ_ONLY &&
+            token->type != DEFERRED)
+            continue;
+
+        if (i + 1 >= lexer->count || lexer->tokens[i + 1]->type != SEMICOLON)
+            plx_syntax_error(plx_fn, "no ';' after '%s'", token->value);
+
+        if (token->type == IDEMPOTENT)
+            plx_stmt->is_idempotent = 1;
+        else if (token->type == READ_ONLY)
+            plx_stmt->is_read_only = 1;
+        else
+            plx_stmt->is_deferred = 1;
+    }
+}
+
 static PlxStmt *
 get_plx_stmt(PlxFn *plx_fn, Lexer *lexer)
 {
@@ -453,6 +503,7 @@ get_plx_stmt(PlxFn *plx_fn, Lexer *lexer)
 
     plx_stmt->cluster_stmt = get_cluster_stmt(plx_fn, lexer);
     plx_stmt->run_stmt     = get_run_stmt(plx_fn, lexer);
+    get_option_stmts(plx_fn, lexer, plx_stmt);
 
     return plx_stmt;
 }
@@ -492,6 +543,9 @@ fill_plx_fn(PlxFn *plx_fn, PlxStmt *plx_stmt)
     PlxHashStmt    *hash_stmt    = run_stmt->hash_stmt;
 
     plx_fn->cluster_name = mctx_strcpy(plx_fn->mctx, cluster_stmt->name);
+    plx_fn->is_idempotent = plx_stmt->is_idempotent;
+    plx_fn->is_read_only = plx_stmt->is_read_only;
+    plx_fn->is_deferred = plx_stmt->is_deferred;
     if (run_stmt->fn_stmt)
         plx_fn->run_query = fill_plx_q(plx_fn, new_plx_query(plx_fn->mctx), run_stmt->fn_stmt, 0);
 
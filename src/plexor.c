@@ -39,22 +39,353 @@ PG_MODULE_MAGIC;
 
 static bool initialized = false;
 
+/* GUC variables */
+char *plx_warmup_clusters = NULL;
+char *plx_preload_functions = NULL;
+int   plx_max_tracked_nodes = 4096;
+int   plx_max_connections = MAX_CONNECTIONS;
+int   plx_function_cache_size = 0;
+bool  plx_async_commit = false;
+char *plx_idempotency_key = NULL;
+char *plx_outbox_database = NULL;
+int   plx_outbox_naptime = 1000;
+int   plx_outbox_batch_size = 100;
+int   plx_mux_workers = 0;
+bool  plx_local_fast_path = false;
+
+
+void _PG_init(void);
 
 PG_FUNCTION_INFO_V1(plexor_call_handler);
 PG_FUNCTION_INFO_V1(plexor_validator);
+PG_FUNCTION_INFO_V1(plexor_warmup);
+PG_FUNCTION_INFO_V1(plexor_precompile);
 
 
-static void plexor_sigterm_handler(SIGNAL_ARGS);
-static void (*prev_sigterm_handler)(int) = NULL;
-
+/*
+ * Close node connections when the backend exits. Waits for nodes are woken
+ * up by the latch, so terminated backend gets here without delay.
+ */
 static void
-plexor_sigterm_handler(SIGNAL_ARGS)
+plexor_proc_exit(int code, Datum arg)
 {
-    pqsignal(SIGTERM, prev_sigterm_handler);
-    elog(WARNING, "plexor: drop all connects by SIGTERM");
+    plx_node_release_all();
     drop_all_connects();
-    if (prev_sigterm_handler)
-        prev_sigterm_handler(postgres_signal_arg);
+}
+
+void
+_PG_init(void)
+{
+    DefineCustomStringVariable("plexor.preload_functions",
+                               "Plexor functions to compile when plexor starts in a backend.",
+                               "Comma separated list of schema names or LIKE patterns "
+                               "of schema qualified function names.",
+                               &plx_preload_functions,
+                               "",
+                               PGC_USERSET,
+                               GUC_LIST_INPUT,
+                               NULL,
+                               NULL,
+                               NULL);
+    DefineCustomStringVariable("plexor.warmup_clusters",
+                               "Clusters to connect to when plexor starts in a backend.",
+                               "Comma separated list of cluster names.",
+                               &plx_warmup_clusters,
+                               "",
+                               PGC_USERSET,
+                               GUC_LIST_INPUT,
+                               NULL,
+                               NULL,
+                               NULL);
+    DefineCustomIntVariable("plexor.max_tracked_nodes",
+                            "Number of nodes tracked by the shared node health registry.",
+                            NULL,
+                            &plx_max_tracked_nodes,
+                            4096,
+                            16,
+                            INT_MAX / 2,
+                            PGC_POSTMASTER,
+                            0,
+                            NULL,
+                            NULL,
+                            NULL);
+    DefineCustomIntVariable("plexor.max_connections",
+                            "Maximum number of node connections kept by a backend.",
+                            "Idle connections are closed in least recently used order, "
+                            "0 means no limit.",
+                            &plx_max_connections,
+                            MAX_CONNECTIONS,
+                            0,
+                            INT_MAX,
+                            PGC_USERSET,
+                            0,
+                            NULL,
+                            NULL,
+                            NULL);
+    DefineCustomIntVariable("plexor.function_cache_size",
+                            "Memory kept by compiled plexor functions of a backend.",
+                            "Least recently used functions are freed at transaction end, "
+                            "0 means no limit.",
+                            &plx_function_cache_size,
+                            0,
+                            0,
+                            MAX_KILOBYTES,
+                            PGC_USERSET,
+                            GUC_UNIT_KB,
+                            NULL,
+                            NULL,
+                            NULL);
+    DefineCustomBoolVariable("plexor.async_commit",
+                             "Don't wait for nodes to acknowledge commit of remote transactions.",
+                             "Failed commit is reported as a warning when the connection "
+                             "is used next time.",
+                             &plx_async_commit,
+                             false,
+                             PGC_USERSET,
+                             0,
+                             NULL,
+                             NULL,
+                             NULL);
+    DefineCustomStringVariable("plexor.idempotency_key",
+                               "Idempotency key sent to nodes along with remote calls.",
+                               "Nodes read it with current_setting('plexor.idempotency_key', true), "
+                               "set by the outbox worker for every call it delivers.",
+                               &plx_idempotency_key,
+                               "",
+                               PGC_USERSET,
+                               GUC_NOT_IN_SAMPLE,
+                               NULL,
+                               NULL,
+                               NULL);
+    DefineCustomStringVariable("plexor.outbox_database",
+                               "Database whose plexor.outbox is delivered by the outbox worker.",
+                               "Empty value disables the worker.",
+                               &plx_outbox_database,
+                               "",
+                               PGC_POSTMASTER,
+                               0,
+                               NULL,
+                               NULL,
+                               NULL);
+    DefineCustomIntVariable("plexor.outbox_naptime",
+                            "Time the outbox worker sleeps when no calls are due.",
+                            NULL,
+                            &plx_outbox_naptime,
+                            1000,
+                            10,
+                            INT_MAX,
+                            PGC_SIGHUP,
+                            GUC_UNIT_MS,
+                            NULL,
+                            NULL,
+                            NULL);
+    DefineCustomIntVariable("plexor.outbox_batch_size",
+                            "Number of outbox calls delivered in one transaction.",
+                            NULL,
+                            &plx_outbox_batch_size,
+                            100,
+                            1,
+                            INT_MAX,
+                            PGC_SIGHUP,
+                            0,
+                            NULL,
+                            NULL,
+                            NULL);
+    DefineCustomIntVariable("plexor.multiplexer_workers",
+                            "Number of workers multiplexing calls of backends over shared node connections.",
+                            "Calls which need no remote transaction go through the workers, "
+                            "0 disables the multiplexer.",
+                            &plx_mux_workers,
+                            0,
+                            0,
+                            MAX_MUX_WORKERS,
+                            PGC_POSTMASTER,
+                            0,
+                            NULL,
+                            NULL,
+                            NULL);
+    DefineCustomBoolVariable("plexor.local_fast_path",
+                             "Call nodes which are the current database in process.",
+                             "The call runs inside the current transaction instead of "
+                             "a connection to the node.",
+                             &plx_local_fast_path,
+                             false,
+                             PGC_USERSET,
+                             0,
+                             NULL,
+                             NULL,
+                             NULL);
+    plx_health_init();
+    plx_outbox_init();
+    plx_mux_init();
+}
+
+/*
+ * Warm up a single cluster from plexor.warmup_clusters. It runs in the
+ * transaction of the first plexor call, so any error is reported as a
+ * warning and the call itself goes on.
+ */
+static void
+warmup_startup_cluster(char *name)
+{
+    MemoryContext old_ctx   = CurrentMemoryContext;
+    ResourceOwner old_owner = CurrentResourceOwner;
+
+    BeginInternalSubTransaction(NULL);
+    MemoryContextSwitchTo(old_ctx);
+
+    PG_TRY();
+    {
+        warmup_plx_cluster(get_plx_cluster(name), false);
+        ReleaseCurrentSubTransaction();
+        MemoryContextSwitchTo(old_ctx);
+        CurrentResourceOwner = old_owner;
+    }
+    PG_CATCH();
+    {
+        ErrorData *edata;
+
+        MemoryContextSwitchTo(old_ctx);
+        edata = CopyErrorData();
+        FlushErrorState();
+        RollbackAndReleaseCurrentSubTransaction();
+        MemoryContextSwitchTo(old_ctx);
+        CurrentResourceOwner = old_owner;
+
+        elog(WARNING, "plexor: warmup of cluster (%s) failed: %s", name, edata->message);
+        FreeErrorData(edata);
+    }
+    PG_END_TRY();
+}
+
+static void
+warmup_startup_clusters(void)
+{
+    char     *raw_names;
+    List     *names;
+    ListCell *cell;
+
+    if (!plx_warmup_clusters || !*plx_warmup_clusters)
+        return;
+
+    raw_names = pstrdup(plx_warmup_clusters);
+    if (!SplitIdentifierString(raw_names, ',', &names))
+    {
+        elog(WARNING, "plexor: invalid list syntax in plexor.warmup_clusters");
+        return;
+    }
+    foreach(cell, names)
+        warmup_startup_cluster((char *) lfirst(cell));
+}
+
+/*
+ * Compile a plexor function in subtransaction, so a function failed to
+ * compile is reported as a warning and doesn't break the caller.
+ */
+static bool
+precompile_fn(Oid fn_oid)
+{
+    MemoryContext old_ctx   = CurrentMemoryContext;
+    ResourceOwner old_owner = CurrentResourceOwner;
+    volatile bool is_compiled = false;
+
+    BeginInternalSubTransaction(NULL);
+    MemoryContextSwitchTo(old_ctx);
+
+    PG_TRY();
+    {
+        is_compiled = precompile_plx_fn(fn_oid);
+        ReleaseCurrentSubTransaction();
+        MemoryContextSwitchTo(old_ctx);
+        CurrentResourceOwner = old_owner;
+    }
+    PG_CATCH();
+    {
+        ErrorData *edata;
+
+        MemoryContextSwitchTo(old_ctx);
+        edata = CopyErrorData();
+        FlushErrorState();
+        RollbackAndReleaseCurrentSubTransaction();
+        MemoryContextSwitchTo(old_ctx);
+        CurrentResourceOwner = old_owner;
+
+        elog(WARNING, "plexor: precompile of function %u failed: %s", fn_oid, edata->message);
+        FreeErrorData(edata);
+        is_compiled = false;
+    }
+    PG_END_TRY();
+    return is_compiled;
+}
+
+/*
+ * Compile plexor functions whose "schema.name" is LIKE the pattern,
+ * pattern without a dot is a schema name. Returns the number of functions
+ * compiled, polymorphic functions are skipped.
+ */
+static int
+precompile_fns(const char *pattern)
+{
+    Oid     argtypes[1] = { TEXTOID };
+    Datum   values[1];
+    Oid    *fn_oids;
+    int     nfns;
+    int     ncompiled = 0;
+    int     i;
+
+    if (!strchr(pattern, '.'))
+        pattern = psprintf("%s.%%", pattern);
+    values[0] = CStringGetTextDatum(pattern);
+
+    if (SPI_connect() != SPI_OK_CONNECT)
+        elog(ERROR, "plexor: SPI_connect failed");
+    if (SPI_execute_with_args("select p.oid"
+                              "  from pg_catalog.pg_proc p"
+                              "  join pg_catalog.pg_language l on l.oid = p.prolang"
+                              "  join pg_catalog.pg_namespace n on n.oid = p.pronamespace"
+                              " where l.lanname = 'plexor'"
+                              "   and n.nspname || '.' || p.proname like $1",
+                              1, argtypes, values, NULL, true, 0) != SPI_OK_SELECT)
+        elog(ERROR, "plexor: failed to find functions matching '%s'", pattern);
+
+    nfns = SPI_processed;
+    fn_oids = SPI_palloc(sizeof(Oid) * (nfns + 1));
+    for (i = 0; i < nfns; i++)
+    {
+        bool isnull;
+
+        fn_oids[i] = DatumGetObjectId(SPI_getbinval(SPI_tuptable->vals[i],
+                                                    SPI_tuptable->tupdesc,
+                                                    1,
+                                                    &isnull));
+    }
+    SPI_finish();
+
+    for (i = 0; i < nfns; i++)
+        if (precompile_fn(fn_oids[i]))
+            ncompiled++;
+    pfree(fn_oids);
+    return ncompiled;
+}
+
+static void
+preload_startup_functions(void)
+{
+    char     *raw_patterns;
+    List     *patterns;
+    ListCell *cell;
+
+    if (!plx_preload_functions || !*plx_preload_functions)
+        return;
+
+    raw_patterns = pstrdup(plx_preload_functions);
+    if (!SplitIdentifierString(raw_patterns, ',', &patterns))
+    {
+        elog(WARNING, "plexor: invalid list syntax in plexor.preload_functions");
+        return;
+    }
+    foreach(cell, patterns)
+        precompile_fns((char *) lfirst(cell));
 }
 
 static void
@@ -65,12 +396,15 @@ plx_startup_init(void)
 
     plx_cluster_cache_init();
     plx_conn_cache_init();
+    plx_type_cache_init();
     plx_fn_cache_init();
-    execute_init();
     srand(time(NULL));
-    prev_sigterm_handler = pqsignal(SIGTERM, plexor_sigterm_handler);
+    on_proc_exit(plexor_proc_exit, (Datum) 0);
 
     initialized = true;
+
+    preload_startup_functions();
+    warmup_startup_clusters();
 }
 
 static int
@@ -115,27 +449,59 @@ get_nnode(PlxFn *plx_fn, FunctionCallInfo fcinfo)
     return DatumGetInt32(val);
 }
 
-static PlxConn*
-select_plx_conn(FunctionCallInfo fcinfo, PlxCluster *plx_cluster, PlxFn *plx_fn)
+/*
+ * Random node, nodes considered down are skipped if possible. With cluster
+ * option any_affinity nodes already used by the session go first.
+ */
+static int
+get_any_nnode(PlxCluster *plx_cluster)
+{
+    int start;
+    int i;
+
+    /* get_plx_conn() reports the cluster without nodes */
+    if (plx_cluster->nnodes == 0)
+        return 0;
+    if (plx_cluster->any_affinity)
+    {
+        int nnode = get_plx_affinity_nnode(plx_cluster);
+
+        if (nnode >= 0)
+            return nnode;
+    }
+
+    start = rand() % plx_cluster->nnodes;
+    for (i = 0; i < plx_cluster->nnodes; i++)
+    {
+        int nnode = (start + i) % plx_cluster->nnodes;
+
+        if (is_plx_node_available(plx_cluster, nnode, false))
+            return nnode;
+    }
+    return start;
+}
+
+static int
+select_nnode(FunctionCallInfo fcinfo, PlxCluster *plx_cluster, PlxFn *plx_fn)
 {
     if (plx_fn->run_on == RUN_ON_HASH)
-        return get_plx_conn(plx_cluster, get_nnode(plx_fn, fcinfo));
+        return get_nnode(plx_fn, fcinfo);
     else if (plx_fn->run_on == RUN_ON_NNODE)
-        return get_plx_conn(plx_cluster, plx_fn->nnode);
+        return plx_fn->nnode;
     else if (plx_fn->run_on == RUN_ON_ANODE)
-        return get_plx_conn(plx_cluster, PG_GETARG_DATUM(plx_fn->anode));
+        return PG_GETARG_INT32(plx_fn->anode);
     else if (plx_fn->run_on == RUN_ON_ANY)
-        return get_plx_conn(plx_cluster, rand() % plx_cluster->nnodes);
+        return get_any_nnode(plx_cluster);
     else if (plx_fn->run_on == RUN_ON_ALL)
-        return get_plx_conn(plx_cluster, 0);
+        return 0;
     else if (plx_fn->run_on == RUN_ON_ALL_COALESCE)
     {
         plx_error(plx_fn, "using run on all coalesce deny for setof");
-        return NULL;
+        return -1;
     }
 
     plx_error(plx_fn, "failed to run on %d", plx_fn->run_on);
-    return NULL;
+    return -1;
 }
 
 
@@ -143,13 +509,26 @@ static void
 retset_execute(FunctionCallInfo fcinfo)
 {
     PlxCluster *plx_cluster = NULL;
-    PlxConn    *plx_conn    = NULL;
     PlxFn      *plx_fn      = NULL;
+    char       *dsn         = NULL;
+    int         nnode;
 
     plx_fn = get_plx_fn(fcinfo);
     plx_cluster = get_plx_cluster(plx_fn->cluster_name);
-    plx_conn = select_plx_conn(fcinfo, plx_cluster, plx_fn);
-    remote_retset_execute(plx_conn, plx_fn, fcinfo, true);
+    nnode = select_nnode(fcinfo, plx_cluster, plx_fn);
+    if (plx_fn->run_on != RUN_ON_ALL)
+    {
+        if (is_plx_local_node(plx_cluster, plx_fn, nnode))
+        {
+            local_retset_execute(plx_cluster, nnode, plx_fn, fcinfo);
+            return;
+        }
+        dsn = get_plx_mux_dsn(plx_cluster, plx_fn, nnode);
+    }
+    if (dsn)
+        mux_retset_execute(plx_cluster, nnode, dsn, plx_fn, fcinfo);
+    else
+        remote_retset_execute(get_plx_conn(plx_cluster, nnode), plx_fn, fcinfo, true);
 }
 
 static Datum
@@ -158,6 +537,8 @@ single_execute(FunctionCallInfo fcinfo)
     PlxCluster *plx_cluster = NULL;
     PlxConn    *plx_conn    = NULL;
     PlxFn      *plx_fn      = NULL;
+    char       *dsn;
+    int         nnode;
     int         i;
 
     plx_fn = get_plx_fn(fcinfo);
@@ -190,10 +571,32 @@ single_execute(FunctionCallInfo fcinfo)
         fcinfo->isnull = true;
         return (Datum) NULL;
     }
-    plx_conn = select_plx_conn(fcinfo, plx_cluster, plx_fn);
+    nnode = select_nnode(fcinfo, plx_cluster, plx_fn);
+    if (is_plx_local_node(plx_cluster, plx_fn, nnode))
+        return local_single_execute(plx_fn, fcinfo);
+    if ((dsn = get_plx_mux_dsn(plx_cluster, plx_fn, nnode)))
+        return mux_single_execute(plx_cluster, nnode, dsn, plx_fn, fcinfo);
+    plx_conn = get_plx_conn(plx_cluster, nnode);
     return remote_single_execute(plx_conn, plx_fn, fcinfo);
 }
 
+#ifdef PLX_DEBUG_ALLOC
+/* Memory of the caller context and of the function contexts */
+static Size
+call_mem_allocated(MemoryContext caller_mctx)
+{
+    return MemoryContextMemAllocated(caller_mctx, true) + plx_fn_mem_allocated();
+}
+
+static void
+log_call_mem_allocated(FunctionCallInfo fcinfo, MemoryContext caller_mctx, Size mem_allocated)
+{
+    elog(DEBUG1, "plexor: function %u call allocated %ld bytes",
+         fcinfo->flinfo->fn_oid,
+         (long) call_mem_allocated(caller_mctx) - (long) mem_allocated);
+}
+#endif
+
 Datum
 plexor_call_handler(PG_FUNCTION_ARGS)
 {
@@ -204,11 +607,33 @@ plexor_call_handler(PG_FUNCTION_ARGS)
     if (fcinfo->flinfo->fn_retset)
     {
         if (SRF_IS_FIRSTCALL())
+        {
+#ifdef PLX_DEBUG_ALLOC
+            MemoryContext caller_mctx   = CurrentMemoryContext;
+            Size          mem_allocated = call_mem_allocated(caller_mctx);
+
+            retset_execute(fcinfo);
+            log_call_mem_allocated(fcinfo, caller_mctx, mem_allocated);
+#else
             retset_execute(fcinfo);
+#endif
+        }
         return get_next_row(fcinfo);
     }
     else
+    {
+#ifdef PLX_DEBUG_ALLOC
+        MemoryContext caller_mctx   = CurrentMemoryContext;
+        Size          mem_allocated = call_mem_allocated(caller_mctx);
+        Datum         result;
+
+        result = single_execute(fcinfo);
+        log_call_mem_allocated(fcinfo, caller_mctx, mem_allocated);
+        return result;
+#else
         return single_execute(fcinfo);
+#endif
+    }
 }
 
 Datum
@@ -251,3 +676,22 @@ plexor_validator(PG_FUNCTION_ARGS)
     ReleaseSysCache(proc_tuple);
     PG_RETURN_VOID();
 }
+
+Datum
+plexor_warmup(PG_FUNCTION_ARGS)
+{
+    char *name       = text_to_cstring(PG_GETARG_TEXT_PP(0));
+    bool  is_prepare = PG_GETARG_BOOL(1);
+
+    plx_startup_init();
+    PG_RETURN_INT32(warmup_plx_cluster(get_plx_cluster(name), is_prepare));
+}
+
+Datum
+plexor_precompile(PG_FUNCTION_ARGS)
+{
+    char *pattern = text_to_cstring(PG_GETARG_TEXT_PP(0));
+
+    plx_startup_init();
+    PG_RETURN_INT32(precompile_fns(pattern));
+}
@@ -38,26 +38,59 @@
 #include <catalog/pg_foreign_data_wrapper.h>
 #include <catalog/pg_user_mapping.h>
 #include <catalog/pg_namespace.h>
+#include <catalog/pg_class.h>
 #include <catalog/pg_proc.h>
 #include <catalog/pg_type.h>
 #include <access/htup_details.h>
 #include <access/reloptions.h>
 #include <access/hash.h>
 #include <access/xact.h>
+#include <access/xlog.h>
+#include <commands/dbcommands.h>
+#include <commands/proclang.h>
+#include <postmaster/bgworker.h>
+#include <postmaster/postmaster.h>
+#include <tcop/tcopprot.h>
+#include <utils/array.h>
+#include <utils/regproc.h>
+#include <utils/ruleutils.h>
 #include <utils/builtins.h>
 #include <utils/lsyscache.h>
 #include <utils/syscache.h>
+#include <utils/inval.h>
 #include <utils/typcache.h>
 #include <utils/memutils.h>
 #include <utils/acl.h>
+#include <utils/guc.h>
+#include <utils/resowner.h>
+#include <utils/varlena.h>
+#include <utils/timestamp.h>
+#include <utils/tuplestore.h>
+#include <utils/uuid.h>
+#if PG_VERSION_NUM < 150000
+#include <utils/int8.h>
+#endif
+#include <storage/dsm.h>
+#include <storage/ipc.h>
+#include <storage/latch.h>
+#include <storage/lwlock.h>
+#include <storage/proc.h>
+#include <storage/shm_mq.h>
+#include <storage/shmem.h>
+#include <storage/spin.h>
 #include <executor/spi.h>
+#include <parser/parse_param.h>
 #include <foreign/foreign.h>
 #include <lib/stringinfo.h>
-#include <sys/epoll.h>
+#include <libpq/pqformat.h>
+#include <lib/ilist.h>
+#include <poll.h>
 #include <funcapi.h>
 #include <libpq-fe.h>
 #include <miscadmin.h>
+#include <pgstat.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <time.h>
 #include <sys/time.h>
 
@@ -72,33 +105,13 @@ longest string of {auto commit | {read committed | serializable } \
 is "read committed read write not deferrable" (42 chars)
 */
 #define MAX_ISOLATION_LEVEL_LEN 42
-#define MAX_DSN_LEN 1024
-#define MAX_NODES 100
+#define MAX_NODES 16384
 #define MAX_RESULTS_PER_EXPR 128
 #define MAX_CONNECTIONS 128
+#define MAX_MUX_WORKERS 64
 #define TYPED_SQL_TMPL "select %s"
 #define UNTYPED_SQL_TMPL "select x from (select * from %s as (%s)) as x"
 
-/* tuple stamp */
-typedef struct TupleStamp {
-    TransactionId   xmin;
-    ItemPointerData tid;
-} TupleStamp;
-
-static inline void
-plx_set_stamp(TupleStamp *stamp, HeapTuple tuple)
-{
-    stamp->xmin = HeapTupleHeaderGetXmin(tuple->t_data);
-    stamp->tid = tuple->t_self;
-}
-
-static inline bool
-plx_check_stamp(TupleStamp *stamp, HeapTuple tuple)
-{
-    return stamp->xmin == HeapTupleHeaderGetXmin(tuple->t_data)
-           && ItemPointerEquals(&stamp->tid, &tuple->t_self);
-}
-
 /* Copy string using specified context */
 static inline char *
 mctx_strcpy(MemoryContext mctx, const char *s)
@@ -110,27 +123,101 @@ mctx_strcpy(MemoryContext mctx, const char *s)
     return memcpy(MemoryContextAlloc(mctx, len), s, len);
 }
 
+/*
+ * Build with -DPLX_DEBUG_ALLOC to log at DEBUG1 level how much memory of the
+ * caller context and of the function contexts (call frames included) grew
+ * during every call. Memory of libpq results is malloc'ed and isn't seen.
+ */
+
+
+/* circuit breaker state of a node */
+typedef enum PlxNodeState
+{
+    PLX_NODE_CLOSED    = 0,                  /* node is healthy, calls pass            */
+    PLX_NODE_OPEN      = 1,                  /* node is down, calls fail immediately   */
+    PLX_NODE_HALF_OPEN = 2,                  /* single probe call tests node recovery  */
+} PlxNodeState;
+
+typedef struct PlxNodeKey
+{
+    Oid             server_oid;              /* foreign server OID */
+    int             nnode;                   /* node number        */
+} PlxNodeKey;
+
+/* Node health shared by all backends. Must be changed under mutex. */
+typedef struct PlxNodeHealth
+{
+    PlxNodeKey      key;                     /* hash key. Must be at the start        */
+    slock_t         mutex;                   /* protects fields below                 */
+    PlxNodeState    state;                   /* circuit breaker state                 */
+    int             nfailures;               /* consecutive connection failures       */
+    TimestampTz     last_failure_time;       /* time of the last failure              */
+    int             probe_pid;               /* backend that probes the node          */
+    TimestampTz     probe_start_time;        /* time at which the probe was started   */
+    int             ncalls;                  /* calls in progress from all backends   */
+    int             call_limit;              /* calls allowed at once, 0 if not set   */
+    int             nqueued;                 /* backends waiting for admission        */
+    int             nlimit_calls;            /* fast calls since the limit was raised */
+    TimestampTz     limit_decrease_time;     /* time at which the limit was halved    */
+} PlxNodeHealth;
+
+/* Connections of one user resolved for cluster nodes */
+typedef struct PlxConnSlots
+{
+    Oid                  userid;                    /* user the DSNs are built for     */
+    uint64               generation;                /* plx_conn_slots_generation value */
+    int                  nconns;                    /* size of conns array             */
+    struct PlxConn     **conns;                     /* connection per node or NULL     */
+    char               **dsns;                      /* DSN with user per node or NULL  */
+    char                *local_nodes;               /* 1 local, -1 remote, 0 unknown   */
+    struct PlxConnSlots *next;                      /* slots of other users            */
+} PlxConnSlots;
 
 typedef struct PlxCluster
 {
     Oid             oid;                            /* foreign server OID  */
     char            name[NAMEDATALEN];              /* foreign server name */
+    uint64          generation;                     /* plx_cluster_generation value */
     char           *isolation_level;
     int             connection_lifetime;
-    char            nodes[MAX_NODES][MAX_DSN_LEN];  /* node DSNs           */
+    int             connection_idle_timeout;        /* seconds idle connection is kept */
+    int             failure_threshold;              /* failures to open circuit        */
+    int             failure_timeout;                /* seconds before node is probed   */
+    bool            any_affinity;                   /* run on any prefers used nodes   */
+    int             node_max_calls;                 /* calls to a node at once or 0    */
+    int             node_target_latency;            /* ms, slower calls halve limit    */
+    int             node_queue_timeout;             /* ms to wait for admission        */
+    char          **nodes;                          /* node DSNs           */
+    PlxNodeHealth **node_health;                    /* shared node health  */
     int             nnodes;                         /* nodes count         */
+    PlxConnSlots   *conn_slots;                     /* resolved connections per user   */
 } PlxCluster;
 
 
+/* text format conversion used for a type */
+typedef enum PlxCodec
+{
+    PLX_CODEC_GENERIC = 0,                   /* type input and output functions        */
+    PLX_CODEC_INT2    = 1,
+    PLX_CODEC_INT4    = 2,
+    PLX_CODEC_INT8    = 3,
+    PLX_CODEC_BOOL    = 4,
+    PLX_CODEC_TEXT    = 5,                   /* text and varchar                       */
+    PLX_CODEC_UUID    = 6,
+} PlxCodec;
+
 typedef struct PlxType
 {
     Oid             oid;                     /* type OID */
+    PlxCodec        codec;                   /* built-in conversion of common types  */
     FmgrInfo        send_fn;                 /* OID of binary out convert procedure  */
     FmgrInfo        receive_fn;              /* OID of binary in  convert procedure  */
     FmgrInfo        output_fn;               /* OID of text   out convert procedure  */
     FmgrInfo        input_fn;                /* OID of text   in  convert procedure  */
     Oid             receive_io_params;       /* OID to pass to I/O convert procedure */
-    TupleStamp      stamp;                   /* stamp to check type up to date       */
+    uint32          type_hash;               /* TYPEOID syscache hash of the type    */
+    int             refcount;                /* functions which use the type         */
+    bool            is_valid;                /* type is in the cache                 */
 } PlxType;
 
 
@@ -152,6 +239,26 @@ typedef enum RunOnType
     RUN_ON_ALL_COALESCE = 6,                 /* return all nodes (for single)          */
 } RunOnType;
 
+/* Reusable memory of function calls */
+typedef struct PlxCallFrame
+{
+    char          **args;                    /* run query parameter values                 */
+    int            *arg_lens;                /* run query parameter lengths                */
+    int            *arg_fmts;                /* run query parameter formats                */
+    char           *sql;                     /* query sent to node (typed return)          */
+    MemoryContext   mctx;                    /* encoded values, reset by the next call     */
+    bool            is_busy;                 /* values are being encoded                   */
+} PlxCallFrame;
+
+/* Remote query of untyped record function for one column definition list */
+typedef struct PlxRecordQuery
+{
+    int                    type_mod;         /* blessed typmod of the result row           */
+    int                    natts;            /* result columns count                       */
+    char                  *sql;              /* query with the column definition list      */
+    struct PlxRecordQuery *next;             /* queries for other column definition lists */
+} PlxRecordQuery;
+
 typedef struct PlxFn
 {
     MemoryContext   mctx;                    /* function MemoryContext                     */
@@ -170,12 +277,29 @@ typedef struct PlxFn
     int             nargs;                   /* plexor function arguments count            */
     PlxType        *ret_type;                /* plexor function return type                */
     int             ret_type_mod;            /* tdtypmod for record or -1                  */
+    int             ret_natts;               /* result columns count for record or 0       */
+    PlxRecordQuery *record_queries;          /* queries of untyped record function         */
+    PlxCallFrame   *frame;                   /* memory reused by calls                     */
     bool            is_binary;               /* use binary fotmat to transfer values       */
     bool            is_return_untyped_record;/* return type is untyped record              */
     bool            is_return_void;          /* return type is untyped record              */
-    TupleStamp      stamp;                   /* stamp to determinate function upadte       */
+    bool            is_idempotent;           /* call may be resent over a new connection   */
+    bool            is_read_only;            /* call doesn't need a remote transaction     */
+    bool            is_deferred;             /* void call result is read later             */
+    uint32          proc_hash;               /* PROCOID syscache hash of the function      */
+    bool            is_valid;                /* function or its types were not changed     */
+    Size            mem_size;                /* memory used when compiled                  */
+    dlist_node      lru_node;                /* position in LRU list of cached functions   */
 } PlxFn;
 
+/* Compiled function pinned to FmgrInfo of a call site */
+typedef struct PlxFnExtra
+{
+    PlxFn          *plx_fn;                  /* compiled function                          */
+    uint64          generation;              /* function cache generation when pinned      */
+    PlxRecordQuery *record_query;            /* query for the call site column list        */
+} PlxFnExtra;
+
 typedef struct PlxConn
 {
     PlxCluster     *plx_cluster;             /* cluster date                               */
@@ -184,19 +308,32 @@ typedef struct PlxConn
     char           *dsn;                     /* node dns                                   */
     int             xlevel;                  /* transaction nest level                     */
     time_t          connect_time;            /* time at which connection was opened        */
+    time_t          expire_time;             /* connection_lifetime end with jitter or 0   */
+    time_t          last_used_time;          /* time at which connection was used          */
+    dlist_node      lru_node;                /* position in LRU list of cached connections */
+    StringInfoData  xact_cmds;               /* queued transaction commands, see transaction.c */
+    int             nxact_cmds;              /* number of queued commands                  */
+    int             nxact_results;           /* pipelined commands with results to read    */
+    int             ndeferred;               /* deferred calls with results to read        */
+    int             deferred_level;          /* local nest level the deferred calls made at */
+    bool            is_commit_pending;       /* result of async commit is not read yet     */
+    WaitEventSet   *wait_set;                /* latch and socket events of the connection  */
+    int             wait_sock_pos;           /* position of the socket in wait_set         */
 } PlxConn;
 
 typedef struct PlxResult
 {
     PlxFn          *plx_fn;                  /* plexor function the result is user for     */
     PGresult       *pg_result;               /* result from node                           */
-    PlxConn        *plx_conn;                /* pointer to external connection             */
+    PlxCluster     *plx_cluster;             /* cluster of the node result is got from     */
+    int             nnode;                   /* node number result is got from             */
+    PlxRecordQuery *record_query;            /* untyped record query or NULL               */
 } PlxResult;
 
 /* Structure to keep plx_conn in HTAB's context. */
 typedef struct PlxConnHashEntry
 {
-    char            key[MAX_DSN_LEN];        /* Key value. Must be at the start */
+    const char     *key;                     /* DSN of the connection, must be at the start */
     PlxConn        *plx_conn;                /* Pointer to connection data */
 } PlxConnHashEntry;
 
@@ -209,13 +346,15 @@ void        delete_plx_cluster(PlxCluster *plx_cluster);
 bool        extract_node_num(const char *node_name, int *node_num);
 
 /* type.c */
-bool     is_plx_type_todate(PlxType *plx_type);
-PlxType *new_plx_type(Oid oid, MemoryContext mctx);
+void     plx_type_cache_init(void);
+PlxType *get_plx_type(Oid oid);
+void     release_plx_type(PlxType *plx_type);
+char    *plx_type_output(PlxType *plx_type, Datum value);
+Datum    plx_type_input(PlxType *plx_type, char *value, int len, int type_mod);
 
 
 /* query.c */
 PlxQuery *new_plx_query(MemoryContext mctx);
-void      delete_plx_query(PlxQuery *plx_q);
 void      append_plx_query_arg_index(PlxQuery *plx_q, PlxFn *plx_fn, const char *name);
 PlxQuery *create_plx_query_from_plx_fn(PlxFn *plx_fn);
 
@@ -223,15 +362,22 @@ PlxQuery *create_plx_query_from_plx_fn(PlxFn *plx_fn);
 void   plx_fn_cache_init(void);
 PlxFn *compile_plx_fn(FunctionCallInfo fcinfo, HeapTuple proc_tuple, bool is_validate);
 PlxFn *get_plx_fn(FunctionCallInfo fcinfo);
+PlxRecordQuery *get_plx_record_query(PlxFn *plx_fn, FunctionCallInfo fcinfo);
+bool   precompile_plx_fn(Oid fn_oid);
 PlxFn *plx_fn_lookup_cache(Oid fn_oid);
 void   delete_plx_fn(PlxFn *plx_fn, bool is_cache_delete);
 void   fill_plx_fn_anode(PlxFn* plx_fn, const char *anode_name);
 int    plx_fn_get_arg_index(PlxFn *plx_fn, const char *name);
+#ifdef PLX_DEBUG_ALLOC
+Size   plx_fn_mem_allocated(void);
+#endif
 
 
 /* result.c */
-PlxResult* new_plx_result(PlxConn *plx_conn, PlxFn *plx_fn, PGresult *pg_result, MemoryContext mctx);
-Datum get_row(FunctionCallInfo fcinfo, PlxFn *plx_fn, PGresult *pg_result, int nrow);
+PlxResult* new_plx_result(PlxCluster *plx_cluster, int nnode, PlxFn *plx_fn, PlxRecordQuery *record_query,
+                          PGresult *pg_result, MemoryContext mctx);
+Datum get_row(FunctionCallInfo fcinfo, PlxFn *plx_fn, PlxRecordQuery *record_query,
+              PGresult *pg_result, int nrow);
 Datum get_next_row(FunctionCallInfo fcinfo);
 
 
@@ -240,12 +386,57 @@ void     plx_conn_cache_init(void);
 PlxConn *get_plx_conn(PlxCluster *plx_cluster, int nnode);
 void     delete_plx_conn(PlxConn *plx_conn);
 void     drop_all_connects(void);
+int      wait_plx_conn(PlxConn *plx_conn, int events);
+WaitEventSet *create_wait_set(int nevents, bool is_session);
+int      get_connect_timeout(PGconn *pq_conn);
+char    *get_plx_mux_dsn(PlxCluster *plx_cluster, PlxFn *plx_fn, int nnode);
+bool     is_plx_local_node(PlxCluster *plx_cluster, PlxFn *plx_fn, int nnode);
+
+extern uint64 plx_lost_remote_xacts;
+int      get_plx_affinity_nnode(PlxCluster *plx_cluster);
+int      warmup_plx_cluster(PlxCluster *plx_cluster, bool is_prepare);
+
+/* health.c */
+void plx_health_init(void);
+bool is_plx_node_available(PlxCluster *plx_cluster, int nnode, bool is_probe);
+void plx_node_failure(PlxCluster *plx_cluster, int nnode);
+void plx_node_success(PlxCluster *plx_cluster, int nnode);
+bool plx_node_admit(PlxCluster *plx_cluster, int nnode, TimestampTz *start_time);
+void plx_node_release(PlxCluster *plx_cluster, TimestampTz start_time);
+void plx_node_release_all(void);
 
 /* transaction.c */
 void start_transaction(PlxConn* plx_conn);
+void register_xact_callbacks(void);
+bool finish_async_commit(PlxConn *plx_conn);
+bool send_xact_cmds(PlxConn *plx_conn);
+void queue_idempotency_key(PlxConn *plx_conn);
+void register_deferred_call(PlxConn *plx_conn);
+
+/* outbox.c */
+void plx_outbox_init(void);
+
+/* mux.c */
+void      plx_mux_init(void);
+bool      plx_mux_attach(void);
+PGresult *plx_mux_call(PlxCluster *plx_cluster, int nnode, const char *dsn, const char *sql,
+                       int nargs, char **args, int *arg_lens, int *arg_fmts, int result_fmt);
 
 
 /* plexor.c */
+extern char *plx_warmup_clusters;
+extern char *plx_preload_functions;
+extern int   plx_max_tracked_nodes;
+extern int   plx_max_connections;
+extern int   plx_function_cache_size;
+extern bool  plx_async_commit;
+extern char *plx_idempotency_key;
+extern char *plx_outbox_database;
+extern int   plx_outbox_naptime;
+extern int   plx_outbox_batch_size;
+extern int   plx_mux_workers;
+extern bool  plx_local_fast_path;
+
 void plx_error_with_errcode(PlxFn *plx_fn, int err_code, const char *fmt, ...)
      __attribute__((format(PG_PRINTF_ATTRIBUTE, 3, 4)));
 #define plx_error(func,...) plx_error_with_errcode((func), ERRCODE_INTERNAL_ERROR, __VA_ARGS__)
@@ -256,9 +447,19 @@ void plx_error_with_errcode(PlxFn *plx_fn, int err_code, const char *fmt, ...)
 void parse(PlxFn *plx_fn, const char *body, int len);
 
 /* execute.c */
-void execute_init(void);
 Datum remote_single_execute(PlxConn *plx_conn, PlxFn *plx_fn, FunctionCallInfo fcinfo);
 void remote_retset_execute(PlxConn *plx_conn, PlxFn *plx_fn, FunctionCallInfo fcinfo, bool is_first_call);
 void pg_result_error(PGresult *pg_result);
+void remote_error(const char *diag_sqlstate, const char *diag_primary, const char *diag_detail,
+                  const char *diag_hint, const char *diag_context);
+Datum mux_single_execute(PlxCluster *plx_cluster, int nnode, char *dsn, PlxFn *plx_fn,
+                         FunctionCallInfo fcinfo);
+void mux_retset_execute(PlxCluster *plx_cluster, int nnode, char *dsn, PlxFn *plx_fn,
+                        FunctionCallInfo fcinfo);
+Datum local_single_execute(PlxFn *plx_fn, FunctionCallInfo fcinfo);
+void local_retset_execute(PlxCluster *plx_cluster, int nnode, PlxFn *plx_fn,
+                          FunctionCallInfo fcinfo);
+void collect_deferred_calls(PlxConn *plx_conn);
+bool discard_deferred_calls(PlxConn *plx_conn);
 
 #endif
@@ -78,19 +78,6 @@ create_plx_query_from_plx_fn(PlxFn *plx_fn)
     return plx_q;
 }
 
-void
-delete_plx_query(PlxQuery *plx_q)
-{
-    if (plx_q->sql)
-    {
-        pfree(plx_q->sql->data);
-	pfree(plx_q->sql);
-    }
-    if (plx_q->plx_fn_arg_indexes)
-        pfree(plx_q->plx_fn_arg_indexes);
-    pfree(plx_q);
-}
-
 PlxQuery *
 new_plx_query(MemoryContext mctx)
 {
@@ -31,13 +31,16 @@
 #include "plexor.h"
 
 PlxResult*
-new_plx_result(PlxConn *plx_conn, PlxFn *plx_fn, PGresult *pg_result, MemoryContext mctx)
+new_plx_result(PlxCluster *plx_cluster, int nnode, PlxFn *plx_fn, PlxRecordQuery *record_query,
+               PGresult *pg_result, MemoryContext mctx)
 {
     PlxResult *plx_result;
 
     plx_result = MemoryContextAllocZero(mctx, sizeof(PlxResult));
-    plx_result->plx_conn = plx_conn;
+    plx_result->plx_cluster = plx_cluster;
+    plx_result->nnode = nnode;
     plx_result->plx_fn = plx_fn;
+    plx_result->record_query = record_query;
     plx_result->pg_result = pg_result;
     return plx_result;
 }
@@ -52,10 +55,12 @@ setFixedStringInfo(StringInfo str, void *data, int len)
 }
 
 Datum
-get_row(FunctionCallInfo fcinfo, PlxFn *plx_fn, PGresult *pg_result, int nrow)
+get_row(FunctionCallInfo fcinfo, PlxFn *plx_fn, PlxRecordQuery *record_query,
+        PGresult *pg_result, int nrow)
 {
     StringInfoData  buf;
     Datum           ret;
+    int             type_mod = plx_fn->ret_type_mod;
 
     fcinfo->isnull = !PQntuples(pg_result) || PQgetisnull(pg_result, nrow, 0);
     if (fcinfo->isnull)
@@ -63,15 +68,18 @@ get_row(FunctionCallInfo fcinfo, PlxFn *plx_fn, PGresult *pg_result, int nrow)
 
     if (plx_fn->ret_type->oid == RECORDOID)
     {
-        Oid       oid;
-        TupleDesc tuple_desc;
+        int natts = plx_fn->ret_natts;
 
-        get_call_result_type(fcinfo, &oid, &tuple_desc);
+        if (record_query)
+        {
+            natts = record_query->natts;
+            type_mod = record_query->type_mod;
+        }
         if (
-            tuple_desc &&
-            /* 2 means ( and ), tuple_desc->natts - 1 means ',' count */
+            natts > 0 &&
+            /* 2 means ( and ), natts - 1 means ',' count */
 	    /* example: natts = 3 => (,,) */
-            PQgetlength(pg_result, nrow, 0) == 2 + tuple_desc->natts - 1
+            PQgetlength(pg_result, nrow, 0) == 2 + natts - 1
         )
         {
             fcinfo->isnull = 1;
@@ -89,12 +97,9 @@ get_row(FunctionCallInfo fcinfo, PlxFn *plx_fn, PGresult *pg_result, int nrow)
             ret = ReceiveFunctionCall(&plx_fn->ret_type->receive_fn,
                                       &buf,
                                       plx_fn->ret_type->receive_io_params,
-                                      plx_fn->ret_type_mod);
+                                      type_mod);
         else
-            ret = InputFunctionCall(&plx_fn->ret_type->input_fn,
-                                    buf.data,
-                                    plx_fn->ret_type->receive_io_params,
-                                    plx_fn->ret_type_mod);
+            ret = plx_type_input(plx_fn->ret_type, buf.data, buf.len, type_mod);
     }
     PG_CATCH();
     {
@@ -119,15 +124,16 @@ get_next_row(FunctionCallInfo fcinfo)
     if (call_cntr < funcctx->max_calls)
         SRF_RETURN_NEXT(funcctx, get_row(fcinfo,
                                          plx_result->plx_fn,
+                                         plx_result->record_query,
                                          plx_result->pg_result,
                                          call_cntr));
     PQclear(plx_result->pg_result);
     if (plx_result->plx_fn->run_on == RUN_ON_ALL &&
-        plx_result->plx_conn->nnode + 1 < plx_result->plx_conn->plx_cluster->nnodes)
+        plx_result->nnode + 1 < plx_result->plx_cluster->nnodes)
     {
-        PlxCluster *plx_cluster = plx_result->plx_conn->plx_cluster;
+        PlxCluster *plx_cluster = plx_result->plx_cluster;
         PlxFn      *plx_fn = plx_result->plx_fn;
-        PlxConn    *plx_conn = get_plx_conn(plx_cluster, plx_result->plx_conn->nnode + 1);
+        PlxConn    *plx_conn = get_plx_conn(plx_cluster, plx_result->nnode + 1);
 
 	funcctx->user_fctx = NULL;
         pfree(plx_result);
@@ -34,38 +34,196 @@ extern HTAB *plx_conn_cache;
 
 static bool is_remote_transaction = false;
 static bool is_remote_subtransaction = false;
+static bool is_deferred_subtransaction = false;
 
 
+/*
+ * Transaction commands are not sent to the node right away. They are queued
+ * in the connection, '\0' separated, and sent ahead of the next query over
+ * the connection, or ahead of the commit.
+ */
+static void
+queue_xact_cmd(PlxConn *plx_conn, const char *cmd)
+{
+    if (!plx_conn->xact_cmds.data)
+    {
+        MemoryContext old_ctx = MemoryContextSwitchTo(GetMemoryChunkContext(plx_conn));
+
+        initStringInfo(&plx_conn->xact_cmds);
+        MemoryContextSwitchTo(old_ctx);
+    }
+    appendBinaryStringInfo(&plx_conn->xact_cmds, cmd, strlen(cmd) + 1);
+    plx_conn->nxact_cmds++;
+}
+
+/* Remove the last queued command if it is cmd, so it is never sent */
+static bool
+unqueue_last_xact_cmd(PlxConn *plx_conn, const char *cmd)
+{
+    StringInfo buf = &plx_conn->xact_cmds;
+    int        len = strlen(cmd) + 1;
+    int        pos = buf->len - len;
+
+    if (!plx_conn->nxact_cmds || pos < 0 ||
+        (pos > 0 && buf->data[pos - 1] != '\0') ||
+        memcmp(buf->data + pos, cmd, len) != 0)
+        return false;
+    buf->len = pos;
+    buf->data[pos] = '\0';
+    plx_conn->nxact_cmds--;
+    return true;
+}
+
+static void
+reset_xact_cmds(PlxConn *plx_conn)
+{
+    if (plx_conn->xact_cmds.data)
+        resetStringInfo(&plx_conn->xact_cmds);
+    plx_conn->nxact_cmds = 0;
+}
+
+/* Remote transaction is not started if its start command is still queued */
+static bool
+is_xact_started(PlxConn *plx_conn)
+{
+    return !plx_conn->nxact_cmds ||
+           strncmp(plx_conn->xact_cmds.data, "start transaction", 17) != 0;
+}
+
+/* Append queued commands to sql as a multi-statement string */
+static void
+append_xact_cmds(StringInfo sql, PlxConn *plx_conn)
+{
+    char *cmd = plx_conn->xact_cmds.data;
+    int   i;
+
+    for (i = 0; i < plx_conn->nxact_cmds; i++, cmd += strlen(cmd) + 1)
+        appendStringInfo(sql, "%s; ", cmd);
+}
+
+/*
+ * Send queued transaction commands ahead of the query that is sent next.
+ * With pipelining libpq they share a pipeline with the query and their
+ * results are read by get_pg_result(), otherwise they take a round trip
+ * of their own. Returns false if the connection is broken.
+ */
+bool
+send_xact_cmds(PlxConn *plx_conn)
+{
+    PGconn *pq_conn = plx_conn->pq_conn;
+
+    if (!plx_conn->nxact_cmds)
+        return true;
+#ifdef LIBPQ_HAS_PIPELINING
+    {
+        char *cmd = plx_conn->xact_cmds.data;
+        int   i;
+
+        if (!PQenterPipelineMode(pq_conn))
+            return false;
+        for (i = 0; i < plx_conn->nxact_cmds; i++, cmd += strlen(cmd) + 1)
+            if (!PQsendQueryParams(pq_conn, cmd, 0, NULL, NULL, NULL, NULL, 0))
+                return false;
+        plx_conn->nxact_results = plx_conn->nxact_cmds;
+    }
+#else
+    {
+        StringInfoData sql;
+        PGresult      *pg_result;
+
+        initStringInfo(&sql);
+        append_xact_cmds(&sql, plx_conn);
+        pg_result = PQexec(pq_conn, sql.data);
+        pfree(sql.data);
+        if (PQresultStatus(pg_result) != PGRES_COMMAND_OK &&
+            PQresultStatus(pg_result) != PGRES_TUPLES_OK)
+        {
+            if (PQstatus(pq_conn) != CONNECTION_OK)
+            {
+                PQclear(pg_result);
+                return false;
+            }
+            reset_xact_cmds(plx_conn);
+            pg_result_error(pg_result);
+        }
+        PQclear(pg_result);
+    }
+#endif
+    reset_xact_cmds(plx_conn);
+    return true;
+}
+
+/*
+ * Pass plexor.idempotency_key to the node ahead of the query, the setting is
+ * local to the remote transaction of the query.
+ */
+void
+queue_idempotency_key(PlxConn *plx_conn)
+{
+    char *cmd = psprintf("select pg_catalog.set_config('plexor.idempotency_key', %s, true)",
+                         quote_literal_cstr(plx_idempotency_key));
+
+    queue_xact_cmd(plx_conn, cmd);
+    pfree(cmd);
+}
+
+/*
+ * Deferred call is about to be sent at the current nest level, its result is
+ * read at the end of the subtransaction or of the transaction. Results of
+ * calls made at an outer level are read first, so all the deferred calls of
+ * the connection belong to one level.
+ */
+void
+register_deferred_call(PlxConn *plx_conn)
+{
+    int curlevel = GetCurrentTransactionNestLevel();
+
+    if (plx_conn->ndeferred > 0 && plx_conn->deferred_level < curlevel)
+        collect_deferred_calls(plx_conn);
+    plx_conn->deferred_level = curlevel;
+    if (curlevel > 1)
+        is_deferred_subtransaction = true;
+    register_xact_callbacks();
+}
+
 static void
 subxact_callback(SubXactEvent event,
                  SubTransactionId mySubid,
                  SubTransactionId parentSubid,
                  void *arg)
 {
-    char              sql[1024]; //fixme
+    char              savepoint[32];
+    char              cmd[64];
     HASH_SEQ_STATUS   scan;
     PlxConnHashEntry *entry = NULL;
     int               curlevel;
 
     /* Nothing to do at subxact start, nor after commit. */
-    if (!is_remote_subtransaction ||
+    if ((!is_remote_subtransaction && !is_deferred_subtransaction) ||
         !(event == SUBXACT_EVENT_PRE_COMMIT_SUB ||
           event == SUBXACT_EVENT_ABORT_SUB))
         return;
 
     curlevel = GetCurrentTransactionNestLevel();
-
-    if (event == SUBXACT_EVENT_PRE_COMMIT_SUB)
-        snprintf(sql, sizeof(sql), "release savepoint s%d", curlevel);
-    else
-        snprintf(sql, sizeof(sql),
-                 "rollback to savepoint s%d; release savepoint s%d",
-                 curlevel, curlevel);
+    snprintf(savepoint, sizeof(savepoint), "savepoint s%d", curlevel);
 
     hash_seq_init(&scan, plx_conn_cache);
     while ((entry = (PlxConnHashEntry *) hash_seq_search(&scan)))
     {
         PlxConn *plx_conn = entry->plx_conn;
+
+        /*
+         * Errors of deferred calls are raised inside the subtransaction they
+         * were made in, whether or not the calls opened a remote one.
+         */
+        if (plx_conn->ndeferred > 0 && plx_conn->deferred_level >= curlevel)
+        {
+            if (event == SUBXACT_EVENT_PRE_COMMIT_SUB)
+                collect_deferred_calls(plx_conn);
+            else if (!discard_deferred_calls(plx_conn))
+                continue;
+        }
+
         if (plx_conn->xlevel < curlevel)
             continue;
 
@@ -74,28 +232,274 @@ subxact_callback(SubXactEvent event,
                     (errcode(ERRCODE_RAISE_EXCEPTION),
                      errmsg("missed cleaning up remote subtransaction at level")));
 
-        if (!PQexec(plx_conn->pq_conn, sql))
-            ereport(ERROR,
-                    (errcode(ERRCODE_RAISE_EXCEPTION),
-                     errmsg("error on %s", sql)));
+        /* nothing was run in the savepoint that is not sent yet */
+        if (!unqueue_last_xact_cmd(plx_conn, savepoint))
+        {
+            if (event == SUBXACT_EVENT_ABORT_SUB)
+            {
+                snprintf(cmd, sizeof(cmd), "rollback to savepoint s%d", curlevel);
+                queue_xact_cmd(plx_conn, cmd);
+            }
+            snprintf(cmd, sizeof(cmd), "release savepoint s%d", curlevel);
+            queue_xact_cmd(plx_conn, cmd);
+        }
         plx_conn->xlevel--;
     }
 }
 
+/* Send out the buffered query, false if the connection is broken */
+static bool
+flush_plx_conn(PlxConn *plx_conn)
+{
+    PGconn *pq_conn = plx_conn->pq_conn;
+    int     res;
+
+    while ((res = PQflush(pq_conn)))
+    {
+        int events;
+
+        if (res == -1)
+            return false;
+        events = wait_plx_conn(plx_conn, WL_SOCKET_READABLE | WL_SOCKET_WRITEABLE);
+        if ((events & WL_SOCKET_READABLE) && !PQconsumeInput(pq_conn))
+            return false;
+    }
+    return true;
+}
+
+static bool
+is_xact_end_ok(PGresult *pg_result)
+{
+    return PQresultStatus(pg_result) == PGRES_COMMAND_OK;
+}
+
+/*
+ * Wait for the end of the query and return the result of its first failed
+ * command or the last result, NULL if the connection is broken.
+ */
+static PGresult *
+get_xact_end_result(PlxConn *plx_conn)
+{
+    PGconn   *pq_conn   = plx_conn->pq_conn;
+    PGresult *pg_result = NULL;
+    PGresult *tmp_pg_result;
+
+    for (;;)
+    {
+        if (!PQconsumeInput(pq_conn))
+        {
+            if (pg_result)
+                PQclear(pg_result);
+            return NULL;
+        }
+        if (PQisBusy(pq_conn))
+        {
+            wait_plx_conn(plx_conn, WL_SOCKET_READABLE);
+            continue;
+        }
+        if (!(tmp_pg_result = PQgetResult(pq_conn)))
+            break;
+        if (pg_result && !is_xact_end_ok(pg_result))
+            PQclear(tmp_pg_result);
+        else
+        {
+            if (pg_result)
+                PQclear(pg_result);
+            pg_result = tmp_pg_result;
+        }
+    }
+    return pg_result;
+}
+
+/*
+ * A queued command that failed ahead of commit makes the node skip the
+ * commit and leaves the connection in an aborted transaction. Such
+ * connection is closed, which rolls the transaction back on the node.
+ */
+static bool
+is_xact_ended(PlxConn *plx_conn)
+{
+    return PQstatus(plx_conn->pq_conn) == CONNECTION_OK &&
+           PQtransactionStatus(plx_conn->pq_conn) == PQTRANS_IDLE;
+}
+
+/*
+ * Read the result of commit sent with plexor.async_commit. The transaction
+ * it belongs to is over, so a failure can be only reported as a warning.
+ * Returns false if the connection was closed.
+ */
+bool
+finish_async_commit(PlxConn *plx_conn)
+{
+    PGresult *pg_result;
+    bool      is_ended;
+
+    plx_conn->is_commit_pending = false;
+    pg_result = get_xact_end_result(plx_conn);
+    if (!pg_result || !is_xact_end_ok(pg_result))
+        elog(WARNING, "plexor: asynchronous commit on node %d of cluster (%s) failed: %s",
+             plx_conn->nnode,
+             plx_conn->plx_cluster->name,
+             pg_result
+             ? PQresultErrorField(pg_result, PG_DIAG_MESSAGE_PRIMARY)
+             : PQerrorMessage(plx_conn->pq_conn));
+    if (pg_result)
+        PQclear(pg_result);
+    is_ended = is_xact_ended(plx_conn);
+    if (!is_ended)
+        delete_plx_conn(plx_conn);
+    return is_ended;
+}
+
+/*
+ * Commit remote transactions. Commit is sent to all the nodes first, and
+ * then their results are read, so the nodes commit in parallel. With
+ * plexor.async_commit results are read when connections are used next time.
+ */
+static void
+commit_remote_transactions(PlxConn **plx_conns, int nconns)
+{
+    PGresult      *error_result = NULL;
+    PlxConn       *broken_conn  = NULL;
+    StringInfoData sql;
+    int            i;
+
+    initStringInfo(&sql);
+    for (i = 0; i < nconns; i++)
+    {
+        PlxConn *plx_conn = plx_conns[i];
+
+        plx_conn->xlevel = 0;
+        if (!is_xact_started(plx_conn))
+        {
+            reset_xact_cmds(plx_conn);
+            plx_conns[i] = NULL;
+            continue;
+        }
+        /* queued savepoint commands go first */
+        resetStringInfo(&sql);
+        append_xact_cmds(&sql, plx_conn);
+        appendStringInfoString(&sql, "commit;");
+        reset_xact_cmds(plx_conn);
+        if (!PQsendQuery(plx_conn->pq_conn, sql.data) || !flush_plx_conn(plx_conn))
+        {
+            if (!broken_conn)
+                broken_conn = plx_conn;
+            plx_conns[i] = NULL;
+            continue;
+        }
+        /* result is read on next use if the wait below is interrupted */
+        plx_conn->is_commit_pending = true;
+    }
+    pfree(sql.data);
+
+    if (!plx_async_commit)
+    {
+        for (i = 0; i < nconns; i++)
+        {
+            PlxConn  *plx_conn = plx_conns[i];
+            PGresult *pg_result;
+
+            if (!plx_conn)
+                continue;
+            pg_result = get_xact_end_result(plx_conn);
+            plx_conn->is_commit_pending = false;
+            if (!pg_result)
+            {
+                if (!broken_conn)
+                    broken_conn = plx_conn;
+            }
+            else if (is_xact_end_ok(pg_result) || error_result)
+                PQclear(pg_result);
+            else
+                error_result = pg_result;
+            if (pg_result && !is_xact_ended(plx_conn))
+                delete_plx_conn(plx_conn);
+        }
+    }
+
+    if (error_result)
+        pg_result_error(error_result);
+    if (broken_conn)
+    {
+        char *msg = pstrdup(PQerrorMessage(broken_conn->pq_conn));
+
+        plx_node_failure(broken_conn->plx_cluster, broken_conn->nnode);
+        delete_plx_conn(broken_conn);
+        ereport(ERROR,
+                (errcode(ERRCODE_CONNECTION_FAILURE),
+                 errmsg("plexor: failed to commit remote transaction: %s", msg)));
+    }
+}
+
+/*
+ * Roll back remote transactions in parallel. Errors can't be raised while
+ * aborting, so connections that fail to roll back are closed, which rolls
+ * the transaction back on the node as well.
+ */
+static void
+rollback_remote_transactions(PlxConn **plx_conns, int nconns)
+{
+    int i;
+
+    for (i = 0; i < nconns; i++)
+    {
+        PlxConn *plx_conn = plx_conns[i];
+        bool     is_started = is_xact_started(plx_conn);
+
+        plx_conn->xlevel = 0;
+        reset_xact_cmds(plx_conn);
+        if (!is_started)
+        {
+            plx_conns[i] = NULL;
+            continue;
+        }
+        /* query interrupted by the error is still running */
+        if (PQtransactionStatus(plx_conn->pq_conn) == PQTRANS_ACTIVE ||
+            !PQsendQuery(plx_conn->pq_conn, "rollback;") ||
+            !flush_plx_conn(plx_conn))
+        {
+            delete_plx_conn(plx_conn);
+            plx_conns[i] = NULL;
+        }
+    }
+    for (i = 0; i < nconns; i++)
+    {
+        PlxConn  *plx_conn = plx_conns[i];
+        PGresult *pg_result;
+
+        if (!plx_conn)
+            continue;
+        pg_result = get_xact_end_result(plx_conn);
+        if (pg_result && is_xact_end_ok(pg_result))
+        {
+            PQclear(pg_result);
+            continue;
+        }
+        elog(WARNING, "plexor: rollback on node %d of cluster (%s) failed: %s",
+             plx_conn->nnode,
+             plx_conn->plx_cluster->name,
+             pg_result
+             ? PQresultErrorField(pg_result, PG_DIAG_MESSAGE_PRIMARY)
+             : PQerrorMessage(plx_conn->pq_conn));
+        if (pg_result)
+            PQclear(pg_result);
+        delete_plx_conn(plx_conn);
+    }
+}
+
 static void
 xact_callback(XactEvent event, void *arg)
 {
     HASH_SEQ_STATUS   scan;
-    PlxConnHashEntry *entry = NULL;
-    char             *sql   = NULL;
+    PlxConnHashEntry *entry    = NULL;
+    PlxConn         **plx_conns;
+    int               nconns   = 0;
 
     switch (event)
     {
         case XACT_EVENT_PRE_COMMIT:
-            sql = "commit;";
-            break;
         case XACT_EVENT_ABORT:
-            sql = "rollback;";
             break;
         case XACT_EVENT_PRE_PREPARE:
             ereport(ERROR,
@@ -114,77 +518,77 @@ xact_callback(XactEvent event, void *arg)
     }
 
     /*
-     * Scan all connection cache entries to find open remote transactions, and
-     * close them.
+     * Scan all connection cache entries to find open remote transactions.
+     * They are collected first, as connections may be deleted while closing.
      */
+    plx_conns = palloc(sizeof(PlxConn *) * hash_get_num_entries(plx_conn_cache));
     hash_seq_init(&scan, plx_conn_cache);
     while ((entry = (PlxConnHashEntry *) hash_seq_search(&scan)))
     {
         PlxConn *plx_conn = entry->plx_conn;
 
-        if (plx_conn->xlevel > 0)
+        /* errors of deferred calls abort the transaction */
+        if (plx_conn->ndeferred > 0)
         {
-            PGresult       *pg_result = PQexec(plx_conn->pq_conn, sql);
-            ExecStatusType  status    = PQresultStatus(pg_result);
-
-            if (status == PGRES_FATAL_ERROR)
-            {
-                ereport(
-                    FATAL,
-                    (errmsg("A fatal error occurred: %s", PQerrorMessage(plx_conn->pq_conn)))
-                );
-            }
-            else if (
-                status != PGRES_TUPLES_OK &&
-                status != PGRES_COMMAND_OK &&
-                status != PGRES_COPY_IN &&
-                status != PGRES_COPY_OUT &&
-                status != PGRES_COPY_BOTH
-            )
-                pg_result_error(pg_result);
-            else if (pg_result)
-                PQclear(pg_result);
-            plx_conn->xlevel = 0;
+            if (event == XACT_EVENT_PRE_COMMIT)
+                collect_deferred_calls(plx_conn);
+            else if (!discard_deferred_calls(plx_conn))
+                continue;
         }
+        if (plx_conn->xlevel > 0)
+            plx_conns[nconns++] = plx_conn;
     }
+
+    /* callbacks are left registered if commit fails, abort cleans up then */
+    if (event == XACT_EVENT_PRE_COMMIT)
+        commit_remote_transactions(plx_conns, nconns);
+    else
+        rollback_remote_transactions(plx_conns, nconns);
+    pfree(plx_conns);
+
     UnregisterXactCallback(xact_callback, NULL);
     UnregisterSubXactCallback(subxact_callback, NULL);
     is_remote_transaction = false;
 }
 
+/* Close remote transactions and read deferred calls at local transaction end */
 void
-start_transaction(PlxConn *plx_conn)
+register_xact_callbacks(void)
 {
-    int        curlevel;
-    StringInfo sql = NULL;
-
-    if (!strcmp(plx_conn->plx_cluster->isolation_level, "auto commit"))
-        return;
-
-    curlevel = GetCurrentTransactionNestLevel();
     if (!is_remote_transaction)
     {
         RegisterXactCallback(xact_callback, NULL);
         RegisterSubXactCallback(subxact_callback, NULL);
         is_remote_transaction = true;
     }
+}
+
+void
+start_transaction(PlxConn *plx_conn)
+{
+    char cmd[MAX_ISOLATION_LEVEL_LEN + 64];
+    int  curlevel;
+
+    if (!strcmp(plx_conn->plx_cluster->isolation_level, "auto commit"))
+        return;
+
+    curlevel = GetCurrentTransactionNestLevel();
+    register_xact_callbacks();
 
+    /* sent along with the query, see send_xact_cmds() */
     if (plx_conn->xlevel == 0)
     {
-        sql = makeStringInfo();
-        appendStringInfo(sql,
-                         "start transaction isolation level %s;",
-                         plx_conn->plx_cluster->isolation_level);
+        snprintf(cmd, sizeof(cmd),
+                 "start transaction isolation level %s",
+                 plx_conn->plx_cluster->isolation_level);
+        queue_xact_cmd(plx_conn, cmd);
         plx_conn->xlevel = 1;
     }
 
     while (plx_conn->xlevel < curlevel)
     {
-        if (!sql)
-            sql = makeStringInfo();
-        appendStringInfo(sql, "savepoint s%d; ", (int) ++(plx_conn->xlevel));
+        snprintf(cmd, sizeof(cmd), "savepoint s%d", (int) ++(plx_conn->xlevel));
+        queue_xact_cmd(plx_conn, cmd);
         is_remote_subtransaction = true;
     }
-    if (sql)
-        PQclear(PQexec(plx_conn->pq_conn, sql->data));
 }
@@ -30,22 +30,109 @@
 
 #include "plexor.h"
 
-bool
-is_plx_type_todate(PlxType *plx_type)
+
+/* Structure to keep plx_type in HTAB's context. */
+typedef struct
 {
-    HeapTuple type_tuple;
-    bool      ret;
+    /* Key value. Must be at the start */
+    Oid      oid;
+    /* Pointer to type data */
+    PlxType *plx_type;
+} PlxTypeHashEntry;
 
-    type_tuple = SearchSysCache1(TYPEOID, ObjectIdGetDatum(plx_type->oid));
-    if (!HeapTupleIsValid(type_tuple))
-        elog(ERROR, "cache lookup failed for type %u", plx_type->oid);
+/* Permanent memory area for type info structures */
+static MemoryContext plx_type_mctx;
 
-    ret = plx_check_stamp(&plx_type->stamp, type_tuple);
-    ReleaseSysCache(type_tuple);
-    return ret;
+/* Type cache shared by all functions */
+static HTAB *plx_type_cache = NULL;
+
+static void
+delete_plx_type(PlxType *plx_type)
+{
+    pfree(plx_type);
 }
 
-PlxType *
+/*
+ * Drop changed types from the cache. Types still used by functions are
+ * freed when the last function releases them, the functions are marked
+ * for recompilation by their own callback.
+ */
+static void
+type_syscache_callback(Datum arg, int cacheid, uint32 hashvalue)
+{
+    HASH_SEQ_STATUS   scan;
+    PlxTypeHashEntry *hentry;
+
+    hash_seq_init(&scan, plx_type_cache);
+    while ((hentry = (PlxTypeHashEntry *) hash_seq_search(&scan)))
+    {
+        PlxType *plx_type = hentry->plx_type;
+
+        if (hashvalue != 0 && plx_type->type_hash != hashvalue)
+            continue;
+        hash_search(plx_type_cache, &plx_type->oid, HASH_REMOVE, NULL);
+        plx_type->is_valid = false;
+        if (plx_type->refcount == 0)
+            delete_plx_type(plx_type);
+    }
+}
+
+/* Initialize plexor type cache */
+void
+plx_type_cache_init(void)
+{
+    HASHCTL       ctl;
+    int           flags;
+    int           max_types = 128;
+    MemoryContext old_ctx;
+
+    /* don't allow multiple initializations */
+    if (plx_type_cache)
+        return;
+
+    plx_type_mctx = AllocSetContextCreate(TopMemoryContext,
+                                          "Plexor types context",
+                                          ALLOCSET_SMALL_MINSIZE,
+                                          ALLOCSET_SMALL_INITSIZE,
+                                          ALLOCSET_SMALL_MAXSIZE);
+    MemSet(&ctl, 0, sizeof(ctl));
+    ctl.keysize = sizeof(Oid);
+    ctl.entrysize = sizeof(PlxTypeHashEntry);
+    ctl.hash = oid_hash;
+    ctl.hcxt = plx_type_mctx;
+    flags = HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT;
+
+    old_ctx = MemoryContextSwitchTo(plx_type_mctx);
+    plx_type_cache = hash_create("Plexor types cache", max_types, &ctl, flags);
+    MemoryContextSwitchTo(old_ctx);
+
+    CacheRegisterSyscacheCallback(TYPEOID, type_syscache_callback, (Datum) 0);
+}
+
+static PlxCodec
+get_plx_codec(Oid oid)
+{
+    switch (oid)
+    {
+        case INT2OID:
+            return PLX_CODEC_INT2;
+        case INT4OID:
+            return PLX_CODEC_INT4;
+        case INT8OID:
+            return PLX_CODEC_INT8;
+        case BOOLOID:
+            return PLX_CODEC_BOOL;
+        case TEXTOID:
+        case VARCHAROID:
+            return PLX_CODEC_TEXT;
+        case UUIDOID:
+            return PLX_CODEC_UUID;
+        default:
+            return PLX_CODEC_GENERIC;
+    }
+}
+
+static PlxType *
 new_plx_type(Oid oid, MemoryContext mctx)
 {
     HeapTuple     type_tuple;
@@ -59,13 +146,139 @@ new_plx_type(Oid oid, MemoryContext mctx)
 
     plx_type = MemoryContextAllocZero(mctx, sizeof(PlxType));
     plx_type->oid = type_struct->oid;
+    plx_type->codec = get_plx_codec(plx_type->oid);
     fmgr_info_cxt(type_struct->typsend,    &plx_type->send_fn,    mctx);
     fmgr_info_cxt(type_struct->typreceive, &plx_type->receive_fn, mctx);
     fmgr_info_cxt(type_struct->typoutput,  &plx_type->output_fn,  mctx);
     fmgr_info_cxt(type_struct->typinput,   &plx_type->input_fn,   mctx);
     plx_type->receive_io_params = getTypeIOParam(type_tuple);
-    plx_set_stamp(&plx_type->stamp, type_tuple);
+    plx_type->type_hash = GetSysCacheHashValue1(TYPEOID, ObjectIdGetDatum(plx_type->oid));
 
     ReleaseSysCache(type_tuple);
     return plx_type;
 }
+
+/* Get type from the cache, the caller must release it */
+PlxType *
+get_plx_type(Oid oid)
+{
+    PlxTypeHashEntry *hentry;
+    PlxType          *plx_type;
+    bool              found;
+
+    hentry = hash_search(plx_type_cache, &oid, HASH_FIND, NULL);
+    if (hentry)
+        plx_type = hentry->plx_type;
+    else
+    {
+        plx_type = new_plx_type(oid, plx_type_mctx);
+        plx_type->is_valid = true;
+        hentry = hash_search(plx_type_cache, &oid, HASH_ENTER, &found);
+        hentry->plx_type = plx_type;
+    }
+    plx_type->refcount++;
+    return plx_type;
+}
+
+void
+release_plx_type(PlxType *plx_type)
+{
+    Assert(plx_type->refcount > 0);
+    if (--plx_type->refcount == 0 && !plx_type->is_valid)
+        delete_plx_type(plx_type);
+}
+
+static char *
+uuid_to_cstring(pg_uuid_t *uuid)
+{
+    static const char hex_chars[] = "0123456789abcdef";
+    char             *buf = palloc(2 * UUID_LEN + 5);
+    char             *p   = buf;
+    int               i;
+
+    for (i = 0; i < UUID_LEN; i++)
+    {
+        if (i == 4 || i == 6 || i == 8 || i == 10)
+            *p++ = '-';
+        *p++ = hex_chars[uuid->data[i] >> 4];
+        *p++ = hex_chars[uuid->data[i] & 0x0F];
+    }
+    *p = '\0';
+    return buf;
+}
+
+/*
+ * Text representation of not null value to send it to node. Common types
+ * are converted without function manager.
+ */
+char *
+plx_type_output(PlxType *plx_type, Datum value)
+{
+    char *buf;
+
+    switch (plx_type->codec)
+    {
+        case PLX_CODEC_INT2:
+            buf = palloc(12);
+            pg_ltoa((int32) DatumGetInt16(value), buf);
+            return buf;
+        case PLX_CODEC_INT4:
+            buf = palloc(12);
+            pg_ltoa(DatumGetInt32(value), buf);
+            return buf;
+        case PLX_CODEC_INT8:
+            buf = palloc(21);
+            pg_lltoa(DatumGetInt64(value), buf);
+            return buf;
+        case PLX_CODEC_BOOL:
+            return DatumGetBool(value) ? "t" : "f";
+        case PLX_CODEC_TEXT:
+            return text_to_cstring(DatumGetTextPP(value));
+        case PLX_CODEC_UUID:
+            return uuid_to_cstring(DatumGetUUIDP(value));
+        default:
+            return OutputFunctionCall(&plx_type->output_fn, value);
+    }
+}
+
+/*
+ * Value of text representation got from node. Common types are converted
+ * without function manager, anything unusual is left to the input function.
+ */
+Datum
+plx_type_input(PlxType *plx_type, char *value, int len, int type_mod)
+{
+    switch (plx_type->codec)
+    {
+        case PLX_CODEC_INT2:
+            return Int16GetDatum(pg_strtoint16(value));
+        case PLX_CODEC_INT4:
+            return Int32GetDatum(pg_strtoint32(value));
+        case PLX_CODEC_INT8:
+        {
+#if PG_VERSION_NUM >= 150000
+            return Int64GetDatum(pg_strtoint64(value));
+#else
+            int64 result;
+
+            (void) scanint8(value, false, &result);
+            return Int64GetDatum(result);
+#endif
+        }
+        case PLX_CODEC_BOOL:
+            if (len == 1 && (value[0] == 't' || value[0] == 'f'))
+                return BoolGetDatum(value[0] == 't');
+            break;
+        case PLX_CODEC_TEXT:
+            /* varchar with length limit is checked by the input function */
+            if (type_mod < 0)
+                return PointerGetDatum(cstring_to_text_with_len(value, len));
+            break;
+        default:
+            break;
+    }
+    return InputFunctionCall(&plx_type->input_fn,
+                             value,
+                             plx_type->receive_io_params,
+                             type_mod);
+}
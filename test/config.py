@@ -78,6 +78,14 @@
             'query': 'select * from return_integer_value(0, 42)',
             'result': [{'return_integer_value': 42}]
         },
+        {
+            'query': 'select * from return_bigint_value(0, -9223372036854775808)',
+            'result': [{'return_bigint_value': -9223372036854775808}]
+        },
+        {
+            'query': "select return_uuid_value(0, 'A0EEBC99-9C0B-4EF8-BB6D-6BB9BD380A11')::text as value",
+            'result': [{'value': 'a0eebc99-9c0b-4ef8-bb6d-6bb9bd380a11'}]
+        },
         {
             'query': 'select * from return_integer_array(1, 42)',
             'result': [{'return_integer_array': [1, 42]}]
@@ -149,6 +157,22 @@
                      'as (id integer, name text)',
             'result': [{'id': 1, 'name': 'yes'}]
         },
+        {
+            'query': 'select * from get_untyped_record(1) '
+                     'as (name text, id integer)',
+            'result': [{'name': 'yes', 'id': 1}]
+        },
+        {
+            'query': 'select get_untyped_record_bare(1)',
+            'pgerror': 'ERROR:  Plexor function public.get_untyped_record_bare(): '
+                       'function returning record called in context '
+                       'that cannot accept type record'
+        },
+        {
+            'query': 'select * from get_untyped_record_bare(1) '
+                     'as (id integer, name text)',
+            'result': [{'id': 1, 'name': 'yes'}]
+        },
         {
             'query': 'select * from get_set_of_record(1)',
             'result': [{'id': 1, 'name': 'customer_1'},
@@ -216,6 +240,46 @@
                      ''',
             'result': []
         },
+        {
+            'pre': 'select * from clear_person(1);',
+            'query': '''
+                        select set_persons_in_exception_blocks(1, 6);
+                        select count(*) as n from get_persons(1);
+                     ''',
+            'result': [{'n': 3}]
+        },
+        {
+            'pre': 'select * from clear_person(1);',
+            'query': '''
+                        select count(*) as n from get_persons_read_only(1);
+                        select * from set_person(1, 2, 'two');
+                        select count(*) as n from get_persons_read_only(1);
+                     ''',
+            'result': [{'n': 1}]
+        },
+        {
+            'query': '''
+                        select count(*) from get_persons_read_only(1);
+                        select count(*) as n from pg_stat_activity
+                        where datname = 'node1' and state = 'idle in transaction';
+                     ''',
+            'result': [{'n': 0}]
+        },
+        {
+            'query': '''
+                        select count(*) from get_persons(1);
+                        select count(*) as n from pg_stat_activity
+                        where datname = 'node1' and state = 'idle in transaction';
+                     ''',
+            'result': [{'n': 1}]
+        },
+        {
+            'query': '''
+                        select * from set_person_affinity(2, 3, 'three');
+                        select get_node_number_any() as n;
+                     ''',
+            'result': [{'n': 2}]
+        },
         {
             'query': 'select * from two_args_hash_function(null)',
             'result': [{'two_args_hash_function': 1}]
@@ -231,6 +295,34 @@
                 )
             )
         },
+        {
+            'query': 'select diferred_error_deferred()',
+            'pgerror':
+            '\n'.join(
+                (
+                    'ERROR:  Remote error: duplicate key value violates '
+                    'unique constraint "uni_id"',
+                    'DETAIL:  Remote detail: Key (id)=(1) already exists.'
+                )
+            )
+        },
+        {
+            'pre': 'select * from clear_person(1);',
+            'query': '''
+                        select set_person_deferred(1, 1, 'one');
+                        select set_person_deferred(1, 2, 'two');
+                        select count(*) as n from get_persons(1);
+                     ''',
+            'result': [{'n': 2}]
+        },
+        {
+            'query': 'select catch_deferred_error()',
+            'result': [{'catch_deferred_error': 'caught'}]
+        },
+        {
+            'query': 'select abort_deferred_sleeps() as is_fast',
+            'result': [{'is_fast': True}]
+        },
         {
             'query': 'select test_all_coalesce_on_records()',
             'result': [{'test_all_coalesce_on_records': '(node1,"")'}]
@@ -243,6 +335,225 @@
             'query': 'select get_jsonb(0)',
             'result': [{'get_jsonb': {u'node_id': 0}}]
         },
+        {
+            'query': 'select get_node_number_idempotent(2)',
+            'result': [{'get_node_number_idempotent': 2}]
+        },
+        {
+            'query': "select pg_terminate_backend(pid, 5000) from pg_stat_activity "
+                     "where datname = 'node2'; "
+                     "select get_node_number_idempotent(2)",
+            'result': [{'get_node_number_idempotent': 2}]
+        },
+        {
+            'query': 'select get_node_number_terminate_once(2)',
+            'result': [{'get_node_number_terminate_once': 2}]
+        },
+        {
+            'query': 'set plexor.async_commit = on; '
+                     'select get_node_number_idempotent(1)',
+            'result': [{'get_node_number_idempotent': 1}]
+        },
+        {
+            'query': 'reset plexor.async_commit; '
+                     'select get_node_number_idempotent(1)',
+            'result': [{'get_node_number_idempotent': 1}]
+        },
+        {
+            'query': 'select 1 as n from diferred_error()',
+            'pgerror':
+            '\n'.join(
+                (
+                    'ERROR:  Remote error: duplicate key value violates '
+                    'unique constraint "uni_id"',
+                    'DETAIL:  Remote detail: Key (id)=(1) already exists.'
+                )
+            )
+        },
+        {
+            'query': 'set plexor.async_commit = on; '
+                     'select 1 as n from diferred_error()',
+            'result': [{'n': 1}]
+        },
+        {
+            'query': 'reset plexor.async_commit; '
+                     'select get_node0_number()',
+            'result': [{'get_node0_number': 0}],
+            'notices': [
+                'WARNING:  plexor: asynchronous commit on node 0 of cluster (proxy) '
+                'failed: duplicate key value violates unique constraint "uni_id"'
+            ]
+        },
+        {
+            'query': "select plexor_precompile('public.get_untyped_record') "
+                     "+ plexor_precompile('no_such_schema')",
+            'result': [{'?column?': 1}]
+        },
+        {
+            'query': "select plexor_warmup('proxy')",
+            'result': [{'plexor_warmup': 3}]
+        },
+        {
+            'query': "select plexor_warmup('proxy', true)",
+            'result': [{'plexor_warmup': 3}]
+        },
+        {
+            'query': "alter server proxy options (drop node_2); "
+                     "select plexor_warmup('proxy')",
+            'result': [{'plexor_warmup': 2}]
+        },
+        {
+            'query': "alter server proxy options "
+                     "(add node_2 'dbname=node2 host=127.0.0.1 port=5432'); "
+                     "select plexor_warmup('proxy')",
+            'result': [{'plexor_warmup': 3}]
+        },
+        {
+            'query': "select * from plexor_node_status() where state <> 'closed'",
+            'result': []
+        },
+        {
+            'query': "alter server proxy options "
+                     "(add node_max_calls '16', add node_target_latency '1000', "
+                     "add node_queue_timeout '100'); "
+                     "select get_node_number_idempotent(1)",
+            'result': [{'get_node_number_idempotent': 1}]
+        },
+        {
+            'query': "alter server proxy options "
+                     "(drop node_max_calls, drop node_target_latency, drop node_queue_timeout); "
+                     "select count(*) from plexor_node_status() where calls > 0",
+            'result': [{'count': 0}]
+        },
+        {
+            'requires': "select current_setting('shared_preload_libraries') ~ 'plexor'",
+            'pre': "alter server local options (add node_max_calls '1');",
+            'query': 'select get_backend_pid_nested_local()',
+            'pgerror':
+            '\n'.join(
+                (
+                    'ERROR:  Remote error: node 0 of cluster (local) is saturated',
+                    'DETAIL:  Remote detail: 1 calls to the node are in progress.'
+                )
+            )
+        },
+        {
+            'requires': "select current_setting('shared_preload_libraries') ~ 'plexor'",
+            'pre': 'alter server local options (drop node_max_calls);',
+            'query': "select get_backend_pid_nested_local() <> pg_backend_pid() as is_remote",
+            'result': [{'is_remote': True}]
+        },
+        {
+            'query': "select plexor_enqueue('set_person(integer,integer,text)', "
+                     "'1', '7', 'seven'); "
+                     "delete from plexor.outbox returning args, role::text",
+            'result': [{'args': ['1', '7', 'seven'], 'role': 'postgres'}]
+        },
+        {
+            'query': "set role plexor_test_user; "
+                     "select plexor_enqueue('set_person(integer,integer,text)', "
+                     "'1', '7', 'seven'); "
+                     "reset role; "
+                     "delete from plexor.outbox returning role::text",
+            'result': [{'role': 'plexor_test_user'}]
+        },
+        {
+            'query': "set role plexor_test_user; "
+                     "select plexor_enqueue('set_person_idempotency_key(integer,integer)', "
+                     "'1', '8')",
+            'pgerror': "ERROR:  permission denied for function set_person_idempotency_key"
+        },
+        {
+            'query': "set role plexor_test_user; "
+                     "select plexor_outbox_drain()",
+            'pgerror': "ERROR:  must be superuser to drain the outbox"
+        },
+        {
+            'query': "select plexor_enqueue('get_node(integer)', '1')",
+            'pgerror': "ERROR:  function get_node(integer) is not a plexor function"
+        },
+        {
+            'pre': 'select * from clear_person(1);',
+            'query': "select plexor_enqueue('set_person(integer,integer,text)', "
+                     "'1', '7', 'seven'); "
+                     "select plexor_outbox_drain(); "
+                     "select get_person_name(1, 7) as name, "
+                     "(select count(*) from plexor.outbox) as queued",
+            'result': [{'name': 'seven', 'queued': 0}]
+        },
+        {
+            'pre': 'select * from clear_person(1);',
+            'query': "select plexor_enqueue('set_person_idempotency_key(integer,integer)', "
+                     "'1', '8'); "
+                     "select plexor_outbox_drain(); "
+                     "select get_person_name(1, 8) ~ '^[0-9]+:[0-9]+$' as has_key, "
+                     "current_setting('plexor.idempotency_key', true) as key",
+            'result': [{'has_key': True, 'key': ''}]
+        },
+        {
+            'query': "select plexor_enqueue('set_person(integer,integer,text)', "
+                     "'5', '7', 'seven'); "
+                     "select plexor_outbox_drain(); "
+                     "delete from plexor.outbox "
+                     "returning attempts, last_error, next_attempt_at > now() as is_postponed",
+            'result': [{'attempts': 1,
+                        'last_error': 'node 5 of cluster (proxy) not defined',
+                        'is_postponed': True}]
+        },
+        {
+            'requires': "select current_setting('plexor.multiplexer_workers') = '0'",
+            'query': "select set_config('plexor_test.pid', "
+                     "get_backend_pid_read_only(1)::text, false); "
+                     "select current_setting('plexor_test.pid')::integer = get_backend_pid(1) "
+                     "as is_session",
+            'result': [{'is_session': True}]
+        },
+        {
+            'requires': "select current_setting('plexor.multiplexer_workers') <> '0'",
+            'query': "select set_config('plexor_test.pid', "
+                     "get_backend_pid_read_only(1)::text, false); "
+                     "select current_setting('plexor_test.pid')::integer <> get_backend_pid(1) "
+                     "as is_worker",
+            'result': [{'is_worker': True}]
+        },
+        {
+            'requires': "select current_setting('plexor.multiplexer_workers') = '1'",
+            'query': "select get_backend_pid_read_only(1) = "
+                     "get_backend_pid_read_only_nested_local(1) as is_shared",
+            'result': [{'is_shared': True}]
+        },
+        {
+            'requires': "select current_setting('plexor.multiplexer_workers') <> '0'",
+            'query': 'select raise_error_read_only(1)',
+            'pgerror':
+            '\n'.join(
+                (
+                    'ERROR:  Remote error: node 1 error',
+                    'DETAIL:  Remote detail: raised by test',
+                    'CONTEXT:  Remote context: PL/pgSQL function raise_error(integer) '
+                    'line 3 at RAISE'
+                )
+            )
+        },
+        {
+            'requires': "select current_setting('plexor.multiplexer_workers') <> '0'",
+            'query': 'select get_backend_pid_read_only(1) > 0 as is_alive',
+            'result': [{'is_alive': True}]
+        },
+        {
+            'query': "set plexor.local_fast_path = on; "
+                     "select get_backend_pid_local() = pg_backend_pid() as is_local",
+            'result': [{'is_local': True}]
+        },
+        {
+            'query': "select add_one_local(41) as n",
+            'result': [{'n': '42'}]
+        },
+        {
+            'query': "reset plexor.local_fast_path; "
+                     "select get_backend_pid_local() = pg_backend_pid() as is_local",
+            'result': [{'is_local': False}]
+        },
 
     ]
 }
@@ -80,6 +80,24 @@ begin
 end;
 $$;
 
+create function return_bigint_value(anode_id integer, value bigint)
+returns bigint
+    language plpgsql
+    as $$
+begin
+    return value;
+end;
+$$;
+
+create function return_uuid_value(anode_id integer, value uuid)
+returns uuid
+    language plpgsql
+    as $$
+begin
+    return value;
+end;
+$$;
+
 create function return_integer_array(anode_id integer, value integer)
 returns integer[]
     language plpgsql
@@ -282,6 +300,18 @@ begin
 end;
 $$ language plpgsql;
 
+create sequence terminate_seq;
+
+create or replace
+function get_node_number_terminate_once() returns integer as $$
+begin
+  if nextval('terminate_seq') = 1 then
+    perform pg_terminate_backend(pg_backend_pid());
+  end if;
+  return get_node_number();
+end;
+$$ language plpgsql;
+
 create or replace
 function get_jsonb(
   anode_id integer
@@ -290,3 +320,17 @@ begin
   return jsonb_build_object('node_id', anode_id);
 end;
 $$ language plpgsql;
+
+create or replace
+function set_person_idempotency_key(anode_id integer, aid integer) returns void as $$
+begin
+  perform set_person(anode_id, aid, current_setting('plexor.idempotency_key', true));
+end;
+$$ language plpgsql;
+
+create or replace
+function raise_error(anode_id integer) returns integer as $$
+begin
+  raise exception 'node % error', anode_id using detail = 'raised by test';
+end;
+$$ language plpgsql;
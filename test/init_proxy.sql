@@ -14,6 +14,28 @@ create user mapping
    server proxy
   options (user 'postgres',password '');
 
+create server proxy_affinity foreign data wrapper plexor options (
+    node_0 'dbname=node0 host=127.0.0.1 port=5432',
+    node_1 'dbname=node1 host=127.0.0.1 port=5432',
+    node_2 'dbname=node2 host=127.0.0.1 port=5432',
+    isolation_level 'read committed',
+    any_affinity 'on'
+);
+
+create user mapping
+   for public
+   server proxy_affinity
+  options (user 'postgres',password '');
+
+create server local foreign data wrapper plexor options (
+    node_0 'dbname=proxy host=127.0.0.1 port=5432'
+);
+
+create user mapping
+   for public
+   server local
+  options (user 'postgres',password '');
+
 create type id_name as (
   id integer,
   name text
@@ -105,6 +127,22 @@ returns integer
   run on get_node(anode_id);
 $$;
 
+create or replace function return_bigint_value(anode_id integer, value bigint)
+returns bigint
+    language plexor
+    as $$
+  cluster proxy;
+  run on get_node(anode_id);
+$$;
+
+create or replace function return_uuid_value(anode_id integer, value uuid)
+returns uuid
+    language plexor
+    as $$
+  cluster proxy;
+  run on get_node(anode_id);
+$$;
+
 create or replace function return_integer_array(anode_id integer, value integer)
 returns integer[]
     language plexor
@@ -218,6 +256,14 @@ returns record
   run on get_node(anode_id);
 $$;
 
+create or replace function get_untyped_record_bare(anode_id integer)
+returns record
+    language plexor
+    as $$
+  cluster proxy;
+  run get_untyped_record(anode_id) on get_node(anode_id);
+$$;
+
 create or replace function get_set_of_record(anode_id integer)
 returns table(id integer, name text)
     language plexor
@@ -269,3 +315,194 @@ returns jsonb as $$
   cluster proxy;
   run on get_node(anode_id);
 $$ language plexor;
+
+create or replace
+function get_node_number_idempotent(anode_id integer)
+returns integer as $$
+  cluster proxy;
+  idempotent;
+  run get_node_number() on get_node(anode_id);
+$$ language plexor;
+
+create or replace
+function get_node_number_terminate_once(anode_id integer)
+returns integer as $$
+  cluster proxy;
+  idempotent;
+  run get_node_number_terminate_once() on get_node(anode_id);
+$$ language plexor;
+
+create or replace
+function set_persons_in_exception_blocks(anode_id integer, acount integer)
+returns integer as $$
+declare
+  i integer;
+  n integer := 0;
+begin
+  for i in 1..acount loop
+    begin
+      perform set_person(anode_id, i, 'name' || i);
+      if i % 2 = 0 then
+        raise exception 'rolled back';
+      end if;
+      n := n + 1;
+    exception when raise_exception then
+      null;
+    end;
+  end loop;
+  return n;
+end;
+$$ language plpgsql;
+
+create or replace
+function get_persons_read_only(anode_id integer)
+returns table(id integer, name text) as $$
+  cluster proxy;
+  read only;
+  run get_persons(anode_id) on get_node(anode_id);
+$$ language plexor;
+
+create or replace
+function set_person_affinity(anode_id integer, aid integer, aname text)
+returns void as $$
+  cluster proxy_affinity;
+  run set_person(anode_id, aid, aname) on get_node(anode_id);
+$$ language plexor;
+
+create or replace
+function set_person_idempotency_key(anode_id integer, aid integer)
+returns void as $$
+  cluster proxy;
+  run on get_node(anode_id);
+$$ language plexor;
+revoke execute on function set_person_idempotency_key(integer, integer) from public;
+
+do $$
+begin
+  if not exists (select from pg_roles where rolname = 'plexor_test_user') then
+    create role plexor_test_user;
+  end if;
+end;
+$$;
+
+create or replace
+function get_node_number_any()
+returns integer as $$
+  cluster proxy_affinity;
+  run get_node_number() on any;
+$$ language plexor;
+
+create or replace
+function set_person_deferred(anode_id integer, aid integer, aname text)
+returns void as $$
+  cluster proxy;
+  deferred;
+  run set_person(anode_id, aid, aname) on get_node(anode_id);
+$$ language plexor;
+
+create or replace
+function diferred_error_deferred() returns void as $$
+  cluster proxy;
+  deferred;
+  run diferred_error() on 0;
+$$ language plexor;
+
+create or replace
+function diferred_error_read_only_deferred() returns void as $$
+  cluster proxy;
+  read only;
+  deferred;
+  run diferred_error() on 0;
+$$ language plexor;
+
+create or replace
+function catch_deferred_error() returns text as $$
+begin
+  begin
+    perform diferred_error_read_only_deferred();
+  exception when unique_violation then
+    return 'caught';
+  end;
+  return 'missed';
+end;
+$$ language plpgsql;
+
+create or replace
+function sleep_deferred(asec double precision) returns void as $$
+  cluster proxy;
+  deferred;
+  run pg_sleep(asec) on 0;
+$$ language plexor;
+
+create or replace
+function sleep_read_only_deferred(asec double precision) returns void as $$
+  cluster proxy;
+  read only;
+  deferred;
+  run pg_sleep(asec) on 1;
+$$ language plexor;
+
+create or replace
+function abort_deferred_sleeps() returns boolean as $$
+declare
+  started timestamptz := clock_timestamp();
+begin
+  begin
+    perform sleep_deferred(10);
+    perform sleep_read_only_deferred(10);
+    raise exception 'abort';
+  exception when raise_exception then
+    null;
+  end;
+  return clock_timestamp() - started < interval '5 seconds';
+end;
+$$ language plpgsql;
+
+create or replace
+function get_backend_pid(anode_id integer) returns integer as $$
+  cluster proxy;
+  run pg_backend_pid() on get_node(anode_id);
+$$ language plexor;
+
+create or replace
+function get_backend_pid_read_only(anode_id integer) returns integer as $$
+  cluster proxy;
+  read only;
+  run pg_backend_pid() on get_node(anode_id);
+$$ language plexor;
+
+create or replace
+function get_backend_pid_read_only_nested_local(anode_id integer) returns integer as $$
+  cluster local;
+  run get_backend_pid_read_only(anode_id) on 0;
+$$ language plexor;
+
+create or replace
+function raise_error_read_only(anode_id integer) returns integer as $$
+  cluster proxy;
+  read only;
+  run raise_error(anode_id) on get_node(anode_id);
+$$ language plexor;
+
+create or replace
+function get_backend_pid_local() returns integer as $$
+  cluster local;
+  run pg_backend_pid() on 0;
+$$ language plexor;
+
+create or replace
+function add_one(a integer) returns integer as $$
+  select a + 1;
+$$ language sql;
+
+create or replace
+function add_one_local(a bigint) returns text as $$
+  cluster local;
+  run add_one(a) on 0;
+$$ language plexor;
+
+create or replace
+function get_backend_pid_nested_local() returns integer as $$
+  cluster local;
+  run get_backend_pid_local() on 0;
+$$ language plexor;
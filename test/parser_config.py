@@ -77,5 +77,65 @@
                 "ERROR:  Plexor function public.syntax_error(): unexpected symbol '|'"
             )
         },
+        {
+            'query':
+            '\n'.join(
+                (
+                    'create or replace function idempotent_error()',
+                    'returns text',
+                    '    language plexor',
+                    '    as $$',
+                    '    cluster proxy;',
+                    '    idempotent',
+                    '    run on 0;',
+                    '$$;',
+                )
+            ),
+            'pgerror':
+            (
+                "ERROR:  Plexor function public.idempotent_error(): "
+                "no ';' after 'idempotent'"
+            )
+        },
+        {
+            'query':
+            '\n'.join(
+                (
+                    'create or replace function read_only_error()',
+                    'returns text',
+                    '    language plexor',
+                    '    as $$',
+                    '    cluster proxy;',
+                    '    read;',
+                    '    run on 0;',
+                    '$$;',
+                )
+            ),
+            'pgerror':
+            (
+                "ERROR:  Plexor function public.read_only_error(): "
+                "'only' expected after 'read'"
+            )
+        },
+        {
+            'query':
+            '\n'.join(
+                (
+                    'create or replace function deferred_error()',
+                    'returns text',
+                    '    language plexor',
+                    '    as $$',
+                    '    cluster proxy;',
+                    '    deferred;',
+                    '    run on 0;',
+                    '$$;',
+                )
+            ),
+            'pgerror':
+            (
+                "ERROR:  Plexor function public.deferred_error(): "
+                "deferred function must return void"
+            )
+        },
     ]
 }